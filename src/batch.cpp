@@ -0,0 +1,210 @@
+// rasterbatch <recipe> <input folder> <output folder> [-j threads] [-m warp cache MB] [-a]
+// renders every image in the input folder with the recipe, several images at a time
+// -a writes mean, median, mode, mad and voronoi of the mosaic from one gather, as <name>_<mode>.png
+// rasterbatch --bench-median <image> [-j threads] times the median against the percentile combine
+// rasterbatch --bench-modes <image> [-j threads] times mode switches through the sample cache against renderImage
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+
+#include "engine.h"
+#include "cache.h"
+#include "samplecache.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+bool isImage(const fs::path& path) {
+	string extension = path.extension().string();
+	transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char ch) { return (char)tolower(ch); });
+	return extension == ".jpg" || extension == ".jpeg" || extension == ".png" || extension == ".bmp" || extension == ".tga";
+}
+
+// median (nth_element over every cell) against percentile 0.5 (histogram select) on the same warp map, so only the combine is timed
+int benchMedian(const char* path, int threads) {
+	Image source;
+	if (!source.load(path)) return 1;
+	RenderParams params;
+	params.combineMosaic = true;
+	params.nearest = true;
+	params.percentile = 0.5f;
+	Image median(320, 240), percentile(320, 240);
+	for (int grid : {3, 7, 15, 30}) {
+		params.gridX = params.gridY = grid;
+		WarpMap warpMap;
+		buildWarpMap(params, median.width, median.height, warpMap, threads);
+
+		double ms[2];
+		Image* outputs[2] = {&median, &percentile};
+		for (int i = 0; i < 2; i++) {
+			params.combineMode = i == 0 ? 1 : 6;
+			auto start = chrono::steady_clock::now();
+			renderImage(source, params, *outputs[i], threads, &warpMap);
+			ms[i] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		}
+		int maxDiff = 0;
+		for (size_t i = 0; i < median.pixels.size(); i++) maxDiff = max(maxDiff, abs((int)median.pixels[i] - (int)percentile.pixels[i]));
+		cout << "[INFO] " << grid << "x" << grid << " median " << ms[0] << " ms, percentile " << ms[1] << " ms, max diff " << maxDiff << endl;
+	}
+	return 0;
+}
+
+// every cached mode switch has to match renderImage byte for byte, the first render pays for the fetch
+int benchModes(const char* path, int threads) {
+	Image source;
+	if (!source.load(path)) return 1;
+	RenderParams params;
+	params.combineMosaic = true;
+	params.nearest = false;
+	SampleCache cache((size_t)512 << 20);
+	Image cached(320, 240), direct(320, 240);
+	for (int grid : {3, 7}) {
+		params.gridX = params.gridY = grid;
+		WarpMap warpMap;
+		buildWarpMap(params, cached.width, cached.height, warpMap, threads);
+		for (int mode : {0, 1, 2, 3, 4, 6, 7, 8, 9}) {
+			params.combineMode = mode;
+			params.gridNumber = grid * grid / 2;
+			auto start = chrono::steady_clock::now();
+			cache.render(source, params, cached, threads, &warpMap);
+			double cachedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			int misses = cache.misses;
+			start = chrono::steady_clock::now();
+			renderImage(source, params, direct, threads, &warpMap);
+			double directMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			bool same = cached.pixels == direct.pixels;
+			cout << "[INFO] " << grid << "x" << grid << " " << combineModeNames[mode] << " cached " << cachedMs << " ms (" << misses << " tiles fetched), renderImage " << directMs << " ms" << (same ? "" : ", DIFFERENT") << endl;
+			if (!same) return 1;
+		}
+	}
+	cout << "[INFO] sample cache holds " << (cache.used() >> 20) << " MB" << endl;
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	if (argc >= 3 && (string(argv[1]) == "--bench-median" || string(argv[1]) == "--bench-modes")) {
+		int threads = max(1, (int)thread::hardware_concurrency());
+		for (int i = 3; i + 1 < argc; i++) {
+			if (string(argv[i]) == "-j") threads = max(1, atoi(argv[i + 1]));
+		}
+		return string(argv[1]) == "--bench-median" ? benchMedian(argv[2], threads) : benchModes(argv[2], threads);
+	}
+	if (argc < 4) {
+		cout << "usage: rasterbatch <recipe> <input folder> <output folder> [-j threads] [-m warp cache MB] [-a]" << endl;
+		cout << "       rasterbatch --bench-median <image> [-j threads]" << endl;
+		cout << "       rasterbatch --bench-modes <image> [-j threads]" << endl;
+		return 1;
+	}
+	int threads = max(1, (int)thread::hardware_concurrency());
+	size_t warpCacheBudget = (size_t)1024 << 20;
+	bool allModes = false;
+	for (int i = 4; i < argc; i++) {
+		if (string(argv[i]) == "-a") allModes = true;
+		if (i + 1 == argc) break;
+		if (string(argv[i]) == "-j") threads = max(1, atoi(argv[i + 1]));
+		if (string(argv[i]) == "-m") warpCacheBudget = (size_t)max(0, atoi(argv[i + 1])) << 20;
+	}
+
+	Recipe recipe;
+	if (!loadRecipe(argv[1], recipe)) return 1;
+	if (allModes && !recipe.params.combineMosaic) {
+		cout << "[ERROR] -a needs a recipe with combineMosaic 1" << endl;
+		return 1;
+	}
+
+	// the coefficients are the same for every image so the lens table is built once
+	LensTable lensTable;
+	if (recipe.useLensTable && recipe.params.lens.type == LENS_POLYNOMIAL) {
+		const RenderParams& p = recipe.params;
+		lensTable.build(p.a, p.b, p.c, p.d, p.binarySearchIterations, lensTableRange(p.ratio));
+		if (lensTable.valid) {
+			recipe.params.lensTable = &lensTable;
+			cout << "[INFO] lens table " << lensTable.values.size() << " entries, sampled max error " << lensTable.sampledError << endl;
+		} else {
+			cout << "[INFO] lens table can't reach the tolerance (sampled max error " << lensTable.sampledError << "), using newton" << endl;
+		}
+	}
+
+	vector<fs::path> inputs;
+	error_code error;
+	for (const fs::directory_entry& entry : fs::directory_iterator(argv[2], error)) {
+		if (entry.is_regular_file() && isImage(entry.path())) inputs.push_back(entry.path());
+	}
+	if (error) {
+		cout << "[ERROR] failed to read \"" << argv[2] << "\": " << error.message() << endl;
+		return 1;
+	}
+	sort(inputs.begin(), inputs.end());
+	fs::path outputFolder = argv[3];
+	fs::create_directories(outputFolder, error);
+
+	// one image per thread while there are enough images, leftover cores go to the tiles of each image
+	int imageThreads = min(threads, max(1, (int)inputs.size()));
+	int tileThreads = max(1, threads / imageThreads);
+
+	// every image of the same size warps the same way, so the warp is done once per output size
+	BudgetCache<WarpKey, WarpMap> warpMaps(warpCacheBudget);
+	mutex warpMapMutex;
+	auto getWarpMap = [&](int width, int height) -> shared_ptr<WarpMap> {
+		const RenderParams& p = recipe.params;
+		if (p.aaRes > 1 && !allModes) return nullptr; // renderImage only takes pixel centers from the map, supersampled it warps every sample itself
+		size_t bytes = (size_t)width * (size_t)height * (p.combineMosaic ? (size_t)(p.gridX * p.gridY) : 1) * sizeof(glm::vec2);
+		if (bytes > warpMaps.budget) return nullptr;
+		lock_guard<mutex> lock(warpMapMutex);
+		WarpKey key = warpKey(p, width, height);
+		shared_ptr<WarpMap> map = warpMaps.find(key);
+		if (!map) {
+			map = make_shared<WarpMap>();
+			buildWarpMap(p, width, height, *map, threads);
+			warpMaps.insert(key, map, map->bytes());
+		}
+		return map;
+	};
+
+	atomic<int> nextImage{0};
+	atomic<int> failed{0};
+	mutex printMutex;
+	auto worker = [&]() {
+		for (int i = nextImage++; i < (int)inputs.size(); i = nextImage++) {
+			Image source;
+			if (!source.load(inputs[i].string().c_str())) {
+				failed++;
+				continue;
+			}
+			Image outputs[gatherModeCount];
+			outputs[0].resize(recipe.width > 0 ? recipe.width : source.width, recipe.height > 0 ? recipe.height : source.height);
+			shared_ptr<WarpMap> warpMap = getWarpMap(outputs[0].width, outputs[0].height);
+			if (allModes) renderGatherModes(source, recipe.params, outputs, tileThreads, warpMap.get());
+			else renderImage(source, recipe.params, outputs[0], tileThreads, warpMap.get());
+
+			bool imageFailed = false;
+			for (int mode = 0; mode < (allModes ? gatherModeCount : 1); mode++) {
+				fs::path outputPath = outputFolder / inputs[i].stem();
+				if (allModes) outputPath += string("_") + combineModeNames[gatherModes[mode]];
+				outputPath += ".png";
+				bool saved = outputs[mode].savePng(outputPath.string().c_str());
+				lock_guard<mutex> lock(printMutex);
+				if (saved) {
+					cout << "[INFO] " << inputs[i].string() << " -> " << outputPath.string() << endl;
+				} else {
+					cout << "[ERROR] failed to write \"" << outputPath.string() << "\"" << endl;
+					imageFailed = true;
+				}
+			}
+			if (imageFailed) failed++;
+		}
+	};
+	vector<thread> pool;
+	for (int i = 1; i < imageThreads; i++) pool.emplace_back(worker);
+	worker();
+	for (thread& t : pool) t.join();
+
+	cout << "[INFO] " << (int)inputs.size() - failed << "/" << inputs.size() << " images done" << endl;
+	return failed > 0 ? 1 : 0;
+}
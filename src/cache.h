@@ -0,0 +1,77 @@
+#pragma once
+// least recently used cache that evicts entries until they fit in a byte budget
+// find is a linear scan: warp maps and images are big enough that a budget holds tens of them, the sample cache's 512mb
+// holds a few thousand tiles at 3x3, still little next to the reduction each hit saves
+
+#include <list>
+#include <memory>
+
+template <typename Key, typename Value>
+class BudgetCache {
+public:
+	size_t budget, used = 0;
+
+	BudgetCache(size_t budget) : budget(budget) {}
+
+	std::shared_ptr<Value> find(const Key& key) {
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			if (it->key == key) {
+				entries.splice(entries.begin(), entries, it); // most recently used goes first
+				return entries.front().value;
+			}
+		}
+		return nullptr;
+	}
+	// replaces what was under key, so used counts every key once
+	// false when the value alone is bigger than the budget, nothing is kept then
+	bool insert(const Key& key, std::shared_ptr<Value> value, size_t bytes) {
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			if (it->key == key) {
+				used -= it->bytes;
+				entries.erase(it);
+				break;
+			}
+		}
+		if (bytes > budget) return false;
+		entries.push_front({key, value, bytes});
+		used += bytes;
+		evict();
+		return true;
+	}
+	// for values that get bigger after they were inserted, like a part built the first time it's needed
+	void grow(const Key& key, size_t bytes) {
+		for (Entry& entry : entries) {
+			if (entry.key == key) {
+				entry.bytes += bytes;
+				used += bytes;
+				evict();
+				return;
+			}
+		}
+	}
+	void setBudget(size_t bytes) {
+		budget = bytes;
+		evict();
+	}
+	void clear() {
+		entries.clear();
+		used = 0;
+	}
+	size_t size() const {
+		return entries.size();
+	}
+private:
+	struct Entry {
+		Key key;
+		std::shared_ptr<Value> value;
+		size_t bytes;
+	};
+	std::list<Entry> entries;
+
+	void evict() {
+		while (used > budget && !entries.empty()) {
+			used -= entries.back().bytes;
+			entries.pop_back();
+		}
+	}
+};
@@ -0,0 +1,816 @@
+#include "engine.h"
+
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cmath>
+#include <functional>
+#include <set>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb/stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb/stb_image_write.h>
+
+using namespace std;
+
+void Image::touch() {
+	static atomic<unsigned long long> nextId{0};
+	id = ++nextId;
+}
+bool Image::load(const char* path) {
+	int channels;
+	unsigned char* data = stbi_load(path, &width, &height, &channels, 4);
+	if (!data) {
+		cout << "[ERROR] failed to load \"" << path << "\"" << endl;
+		width = height = 0;
+		pixels.clear();
+		return false;
+	}
+	// flip so row 0 is the bottom like stbi_set_flip_vertically_on_load does for the textures
+	size_t stride = (size_t)width * 4;
+	pixels.resize(stride * (size_t)height);
+	for (int y = 0; y < height; y++) {
+		memcpy(&pixels[(size_t)y * stride], data + (size_t)(height - 1 - y) * stride, stride);
+	}
+	stbi_image_free(data);
+	touch();
+	return true;
+}
+bool Image::savePng(const char* path) const {
+	size_t stride = (size_t)width * 4;
+	vector<unsigned char> flipped(pixels.size());
+	for (int y = 0; y < height; y++) {
+		memcpy(&flipped[(size_t)y * stride], &pixels[(size_t)(height - 1 - y) * stride], stride);
+	}
+	return stbi_write_png(path, width, height, 4, flipped.data(), (int)stride) != 0;
+}
+
+float lensDistortion(float r, float a, float b, float c, float d) {
+	return (a * r * r + b * r + c) * r * r + d * r;
+}
+float inverseLensDistortion(float distortedR, float a, float b, float c, float d, int iterations) {
+	float r = distortedR;
+
+	for (int i = 0; i < iterations; i++) {
+		float f = lensDistortion(r, a, b, c, d) - distortedR;
+		float derivative = r * r * (4.f * a * r + 3.f * b) + 2.f * c * r + d;
+
+		if (abs(derivative) < 1e-6f) {
+			break;
+		}
+
+		r -= f / derivative;
+		if (f == 0.f) break; // converged, the rest of the steps would subtract 0
+	}
+
+	return r;
+}
+
+bool LensTable::matches(float a, float b, float c, float d, int iterations, float maxR) const {
+	return this->a == a && this->b == b && this->c == c && this->d == d && this->iterations == iterations && this->maxR == maxR;
+}
+void LensTable::build(float a, float b, float c, float d, int iterations, float maxR, float tolerance) {
+	this->a = a;
+	this->b = b;
+	this->c = c;
+	this->d = d;
+	this->iterations = iterations;
+	this->maxR = maxR;
+
+	// double the size until the sampled error in between the entries is small enough
+	vector<float> radii, checks, exact;
+	for (int size = rowWidth; size <= rowWidth * 64; size *= 2) {
+		float step = maxR / (float)(size - 1);
+		radii.resize(size);
+		for (int i = 0; i < size; i++) radii[i] = (float)i * step;
+		values.resize(size);
+		inverseLensDistortionBatch(radii.data(), values.data(), size, a, b, c, d, iterations);
+
+		checks.resize((size_t)(size - 1) * 3);
+		for (int i = 0; i < size - 1; i++) {
+			for (int j = 0; j < 3; j++) checks[(size_t)i * 3 + j] = ((float)i + (float)(j + 1) * 0.25f) * step;
+		}
+		exact.resize(checks.size());
+		inverseLensDistortionBatch(checks.data(), exact.data(), (int)checks.size(), a, b, c, d, iterations);
+		sampledError = 0.f;
+		for (size_t i = 0; i < checks.size(); i++) {
+			float difference = abs(lookup(checks[i]) - exact[i]);
+			if (!(difference <= sampledError)) sampledError = difference; // nan counts as huge
+		}
+		valid = sampledError <= tolerance;
+		if (valid) break;
+	}
+}
+float LensTable::lookup(float distortedR) const {
+	float x = values.size() < 2 ? -1.f : distortedR / maxR * (float)(values.size() - 1);
+	if (!(x >= 0.f) || x >= (float)(values.size() - 1)) return inverseLensDistortion(distortedR, a, b, c, d, iterations);
+	int i = (int)x;
+	return values[i] + (values[i + 1] - values[i]) * (x - (float)i);
+}
+float lensTableRange(float ratio) {
+	return sqrt(ratio * ratio + 1.f) * 1.5f;
+}
+
+const char* lensModelNames[3] = {"polynomial", "division", "inversePolynomial"};
+
+LensModel fitLensModel(int type, float a, float b, float c, float d, int iterations, float maxR) {
+	LensModel model;
+	model.type = type;
+	if (type == LENS_POLYNOMIAL) return model;
+
+	const int samples = 512;
+	vector<float> radii(samples), target(samples);
+	for (int i = 0; i < samples; i++) radii[i] = maxR * (float)(i + 1) / (float)samples;
+	inverseLensDistortionBatch(radii.data(), target.data(), samples, a, b, c, d, iterations);
+
+	if (type == LENS_DIVISION) {
+		// r / target - 1 = k r^2 is linear in k
+		double numerator = 0., denominator = 0.;
+		for (int i = 0; i < samples; i++) {
+			double r = radii[i], r2 = r * r;
+			if (target[i] == 0.f) continue;
+			numerator += r2 * (r / target[i] - 1.);
+			denominator += r2 * r2;
+		}
+		model.k = denominator > 0. ? (float)(numerator / denominator) : 0.f;
+	} else {
+		// target / r = e0 + e1 r + e2 r^2 + e3 r^3, normal equations weighted by r^2 so the error is in radius units
+		double m[4][5] = {};
+		for (int i = 0; i < samples; i++) {
+			double r = radii[i], y = target[i] / r, w = r * r;
+			double powers[4] = {1., r, r * r, r * r * r};
+			for (int row = 0; row < 4; row++) {
+				for (int col = 0; col < 4; col++) m[row][col] += w * powers[row] * powers[col];
+				m[row][4] += w * powers[row] * y;
+			}
+		}
+		for (int col = 0; col < 4; col++) { // gaussian elimination with partial pivoting
+			int pivot = col;
+			for (int row = col + 1; row < 4; row++) if (abs(m[row][col]) > abs(m[pivot][col])) pivot = row;
+			for (int i = 0; i < 5; i++) swap(m[col][i], m[pivot][i]);
+			if (m[col][col] == 0.) continue;
+			for (int row = 0; row < 4; row++) {
+				if (row == col) continue;
+				double factor = m[row][col] / m[col][col];
+				for (int i = col; i < 5; i++) m[row][i] -= factor * m[col][i];
+			}
+		}
+		for (int i = 0; i < 4; i++) model.inverse[i] = m[i][i] == 0. ? 0.f : (float)(m[i][4] / m[i][i]);
+	}
+
+	model.maxError = lensModelError(model, a, b, c, d, iterations, maxR);
+	return model;
+}
+float lensModelError(const LensModel& model, float a, float b, float c, float d, int iterations, float maxR) {
+	if (model.type == LENS_POLYNOMIAL) return 0.f;
+	const int samples = 512; // the radii fitLensModel fits on
+	vector<float> radii(samples), target(samples);
+	for (int i = 0; i < samples; i++) radii[i] = maxR * (float)(i + 1) / (float)samples;
+	inverseLensDistortionBatch(radii.data(), target.data(), samples, a, b, c, d, iterations);
+
+	RenderParams params;
+	params.lens = model;
+	float maxError = 0.f;
+	for (int i = 0; i < samples; i++) {
+		float error = abs(lensInverse(radii[i], params) - target[i]);
+		if (!(error <= maxError)) maxError = error;
+	}
+	return maxError;
+}
+
+static glm::mat3 adj(glm::mat3 m) {
+	return glm::mat3(
+		m[1][1]*m[2][2]-m[2][1]*m[1][2], m[2][0]*m[1][2]-m[1][0]*m[2][2], m[1][0]*m[2][1]-m[2][0]*m[1][1],
+		m[2][1]*m[0][2]-m[0][1]*m[2][2], m[0][0]*m[2][2]-m[2][0]*m[0][2], m[2][0]*m[0][1]-m[0][0]*m[2][1],
+		m[0][1]*m[1][2]-m[1][1]*m[0][2], m[1][0]*m[0][2]-m[0][0]*m[1][2], m[0][0]*m[1][1]-m[1][0]*m[0][1]
+	);
+}
+static glm::mat3 adj321(glm::mat3 m) {
+	return glm::mat3(
+		m[1][1]*m[2][2]-m[1][2]*m[2][1], m[0][2]*m[2][1]-m[0][1]*m[2][2], m[0][1]*m[1][2]-m[0][2]*m[1][1],
+		m[1][2]*m[2][0]-m[1][0]*m[2][2], m[0][0]*m[2][2]-m[0][2]*m[2][0], m[0][2]*m[1][0]-m[0][0]*m[1][2],
+		m[1][0]*m[2][1]-m[1][1]*m[2][0], m[0][1]*m[2][0]-m[0][0]*m[2][1], m[0][0]*m[1][1]-m[0][1]*m[1][0]
+	);
+}
+static glm::mat3 multmm(glm::mat3 a, glm::mat3 b) { // multiply two matrices
+	glm::mat3 c;
+	for (int i = 0; i != 3; ++i) {
+		for (int j = 0; j != 3; ++j) {
+			float cij = 0.f;
+			for (int k = 0; k != 3; ++k) {
+				cij += a[i][k]*b[k][j];
+			}
+			c[i][j] = cij;
+		}
+	}
+	return c;
+}
+static glm::mat3 basisToPoints(float x1, float y1, float x2, float y2, float x3, float y3, float x4, float y4) {
+	glm::mat3 m = glm::mat3(
+		x1, x2, x3,
+		y1, y2, y3,
+		1.f,  1.f,  1.f
+	);
+	glm::vec3 v = adj(m) * glm::vec3(x4, y4, 1.);
+	return multmm(m, glm::mat3(
+		v.x, 0.f, 0.f,
+		0.f, v.y, 0.f,
+		0.f, 0.f, v.z
+	));
+}
+static glm::mat3 general2DProjection(
+	float x1s, float y1s, float x1d, float y1d,
+	float x2s, float y2s, float x2d, float y2d,
+	float x3s, float y3s, float x3d, float y3d,
+	float x4s, float y4s, float x4d, float y4d
+) {
+	glm::mat3 s = basisToPoints(x1s, y1s, x2s, y2s, x3s, y3s, x4s, y4s);
+	glm::mat3 d = basisToPoints(x1d, y1d, x2d, y2d, x3d, y3d, x4d, y4d);
+	return multmm(d, adj321(s));
+}
+glm::mat3 transform2d(float x1, float y1, float x2, float y2, float x3, float y3, float x4, float y4) {
+	float w = 1.f;
+	float h = 1.f;
+	glm::mat3 t = general2DProjection(
+		0.f, 0.f, x1, y1,
+		w , 0.f, x4, y4,
+		0.f, h , x2, y2,
+		w , h , x3, y3
+	);
+	for (int x = 0; x < 3; x++) {
+		for (int y = 0; y < 3; y++) {
+			t[x][y] /= t[2][2];
+		}
+	}
+	t = glm::mat3(
+		t[0][0], t[1][0], t[2][0],
+		t[0][1], t[1][1], t[2][1],
+		t[0][2], t[1][2], t[2][2]
+	);
+	return t;
+}
+
+// everything below mirrors fragment.fsh, keep them in sync
+static const int howmanycolors = paletteSize;
+const glm::vec3 palette[howmanycolors] = {
+	{0.09f, 0.19f, 0.32f}, // blue
+	{0.50f, 0.50f, 0.50f}, // gray
+	{0.15f, 0.06f, 0.12f} // red
+};
+static const int howman = maxExactMadCells;
+
+static glm::vec2 transformUvToGridCell(glm::vec2 uv, int gridCellX, int gridCellY, const RenderParams& params) {
+	uv.x = glm::mix((float)gridCellX / (float)params.gridX, (float)(gridCellX + 1) / (float)params.gridX, uv.x);
+	uv.y = glm::mix((float)gridCellY / (float)params.gridY, (float)(gridCellY + 1) / (float)params.gridY, uv.y);
+	return uv;
+}
+static bool usesLensTable(const RenderParams& params) {
+	const LensTable* table = params.lensTable;
+	return params.lens.type == LENS_POLYNOMIAL && table && table->valid && table->a == params.a && table->b == params.b && table->c == params.c && table->d == params.d && table->iterations == params.binarySearchIterations;
+}
+float lensInverse(float r, const RenderParams& params) {
+	const LensModel& lens = params.lens;
+	switch (lens.type) {
+	case LENS_DIVISION:{
+		float denominator = 1.f + lens.k * r * r;
+		return denominator > 0.f ? r / denominator : lensOutside; // past the pole of a negative k
+	}
+	case LENS_INVERSE_POLYNOMIAL:
+		return r * (lens.inverse.x + r * (lens.inverse.y + r * (lens.inverse.z + r * lens.inverse.w)));
+	}
+	if (usesLensTable(params)) return params.lensTable->lookup(r);
+	return inverseLensDistortion(r, params.a, params.b, params.c, params.d, params.binarySearchIterations);
+}
+float lensForward(float r, const RenderParams& params) {
+	if (params.lens.type == LENS_DIVISION) {
+		// solves r = out / (1 + k out^2) for out, written so k = 0 doesn't divide by zero
+		// a negative discriminant is past the largest radius a positive k reaches, no output radius maps there
+		float discriminant = 1.f - 4.f * params.lens.k * r * r;
+		if (discriminant < 0.f) return lensOutside;
+		return 2.f * r / (1.f + sqrt(discriminant));
+	}
+	return lensDistortion(r, params.a, params.b, params.c, params.d); // the inverse polynomial was fitted to this
+}
+glm::vec2 transformUv(glm::vec2 uv, const RenderParams& params) {
+	if (params.showTransform) {
+		glm::vec3 transformed = params.trans * glm::vec3(uv, 1.f);
+		uv = glm::vec2(transformed) / transformed.z;
+	}
+
+	// lens distortion
+	uv = uv * 2.f - 1.f;
+	uv.x *= params.ratio;
+	float r = glm::length(uv);
+	if (r > 0.f) uv *= lensInverse(r, params) / r;
+	uv.x /= params.ratio;
+	return (uv + 1.f) * 0.5f;
+}
+void transformUvs(glm::vec2* uvs, int n, const RenderParams& params) {
+	thread_local vector<float> radii, inverted;
+	radii.resize(n);
+	inverted.resize(n);
+	for (int i = 0; i < n; i++) {
+		glm::vec2 uv = uvs[i];
+		if (params.showTransform) {
+			glm::vec3 transformed = params.trans * glm::vec3(uv, 1.f);
+			uv = glm::vec2(transformed) / transformed.z;
+		}
+		uv = uv * 2.f - 1.f;
+		uv.x *= params.ratio;
+		uvs[i] = uv;
+		radii[i] = glm::length(uv);
+	}
+	if (params.lens.type != LENS_POLYNOMIAL || usesLensTable(params)) {
+		for (int i = 0; i < n; i++) inverted[i] = lensInverse(radii[i], params);
+	} else {
+		inverseLensDistortionBatch(radii.data(), inverted.data(), n, params.a, params.b, params.c, params.d, params.binarySearchIterations);
+	}
+	for (int i = 0; i < n; i++) {
+		glm::vec2 uv = uvs[i];
+		if (radii[i] > 0.f) uv *= inverted[i] / radii[i];
+		uv.x /= params.ratio;
+		uvs[i] = (uv + 1.f) * 0.5f;
+	}
+}
+static glm::vec4 texel(const Image& source, int x, int y) {
+	if (x < 0 || y < 0 || x >= source.width || y >= source.height) return glm::vec4(0.f); // clamp to border
+	const unsigned char* p = &source.pixels[((size_t)y * (size_t)source.width + (size_t)x) * 4];
+	return glm::vec4(p[0], p[1], p[2], p[3]) * (1.f / 255.f);
+}
+glm::vec4 samplePixel(const Image& source, glm::vec2 uv, bool nearest) {
+	float x = uv.x * (float)source.width;
+	float y = uv.y * (float)source.height;
+	if (nearest) return texel(source, (int)floor(x), (int)floor(y));
+
+	x -= 0.5f;
+	y -= 0.5f;
+	int x0 = (int)floor(x), y0 = (int)floor(y);
+	float fx = x - (float)x0, fy = y - (float)y0;
+	glm::vec4 bottom = glm::mix(texel(source, x0, y0), texel(source, x0 + 1, y0), fx);
+	glm::vec4 top = glm::mix(texel(source, x0, y0 + 1), texel(source, x0 + 1, y0 + 1), fx);
+	return glm::mix(bottom, top, fy);
+}
+// batcher's odd-even merge sort for n values, comparators past n are dropped since padding sorts to the end anyway
+vector<pair<int, int>> sortingNetwork(int n) {
+	vector<pair<int, int>> comparators;
+	int padded = 1;
+	while (padded < n) padded *= 2;
+	for (int p = 1; p < padded; p *= 2) {
+		for (int k = p; k >= 1; k /= 2) {
+			for (int j = k % p; j + k < padded; j += 2 * k) {
+				for (int i = 0; i < min(k, padded - j - k); i++) {
+					if ((i + j) / (2 * p) != (i + j + k) / (2 * p)) continue;
+					if (i + j + k < n) comparators.push_back({i + j, i + j + k});
+				}
+			}
+		}
+	}
+	return comparators;
+}
+// the sorting network minus every comparator that can't reach the outputs
+vector<pair<int, int>> selectionNetwork(int n, const vector<int>& outputs) {
+	vector<pair<int, int>> all = sortingNetwork(n), kept;
+	set<int> needed(outputs.begin(), outputs.end());
+	for (int i = (int)all.size() - 1; i >= 0; i--) {
+		if (!needed.count(all[i].first) && !needed.count(all[i].second)) continue;
+		kept.push_back(all[i]);
+		needed.insert(all[i].first);
+		needed.insert(all[i].second);
+	}
+	reverse(kept.begin(), kept.end());
+	return kept;
+}
+static float getMedian(vector<float>& values) {
+	size_t n = values.size();
+	if (n == 0) return 0.f;
+	nth_element(values.begin(), values.begin() + n / 2, values.end());
+	float upper = values[n / 2];
+	if (n % 2 == 1) return upper;
+	float lower = *max_element(values.begin(), values.begin() + n / 2);
+	return (lower + upper) * 0.5f;
+}
+glm::vec4 fetchPixel(const Image& source, const RenderParams& params, glm::vec2 sourceUv) {
+	glm::vec4 color = samplePixel(source, sourceUv, params.nearest);
+	color.a = color.a < 0.5f ? 0.f : 1.f;
+	return color;
+}
+static glm::vec4 doPixel(const Image& source, const RenderParams& params, glm::vec2 uv) {
+	return fetchPixel(source, params, transformUv(uv, params));
+}
+// the mosaic uv of one output pixel for a grid cell, before any warping
+static glm::vec2 cellUv(glm::vec2 uv, int i, const RenderParams& params) {
+	return transformUvToGridCell(uv, i % params.gridX, i / params.gridX, params);
+}
+static glm::vec2 viewUv(const RenderParams& params, glm::vec2 texcoord) {
+	glm::vec2 uv = glm::vec2(glm::mix(params.aabb.l, params.aabb.r, texcoord.x), glm::mix(params.aabb.b, params.aabb.t, texcoord.y));
+	if (params.combineMosaic) uv -= glm::floor(uv);
+	return uv;
+}
+void cellSourceUvs(const RenderParams& params, int x, int y, int width, int height, glm::vec2* uvs) {
+	glm::vec2 uv = viewUv(params, glm::vec2(((float)x + 0.5f) / (float)width, ((float)y + 0.5f) / (float)height));
+	int cells = params.gridX * params.gridY;
+	for (int i = 0; i < cells; i++) uvs[i] = cellUv(uv, i, params);
+	transformUvs(uvs, cells, params);
+}
+static glm::vec4 combineSamples(const Image& source, const RenderParams& params, const glm::vec2* sourceUvs);
+glm::vec4 renderPixel(const Image& source, const RenderParams& params, glm::vec2 texcoord) {
+	glm::vec2 uv = viewUv(params, texcoord);
+	if (!params.combineMosaic) return doPixel(source, params, uv);
+	if (params.combineMode == 2) return glm::vec4(glm::vec3(doPixel(source, params, cellUv(uv, params.gridNumber, params))), 1.f); // single
+
+	// warp every cell in one batch
+	int cells = params.gridX * params.gridY;
+	thread_local vector<glm::vec2> sourceUvs;
+	sourceUvs.resize(cells);
+	for (int i = 0; i < cells; i++) sourceUvs[i] = cellUv(uv, i, params);
+	transformUvs(sourceUvs.data(), cells, params);
+	return combineSamples(source, params, sourceUvs.data());
+}
+const char* aaPatternNames[3] = {"ordered", "rotated", "jittered"};
+const char* combineModeNames[10] = {"mean", "median", "single", "mode", "mad", "voronoi", "percentile", "stddev", "variation", "trimmed"};
+const int gatherModes[gatherModeCount] = {0, 1, 3, 4, 5};
+
+static unsigned int hashUint(unsigned int x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+glm::vec2 aaOffset(int pattern, int aaRes, int i, int x, int y) {
+	if (aaRes <= 1) return glm::vec2(0.5f);
+	float n = (float)aaRes;
+	int column = i % aaRes, row = i / aaRes;
+	switch (pattern) {
+	case AA_ROTATED:
+		return glm::vec2(((float)column + ((float)row + 0.5f) / n) / n, ((float)row + ((float)(aaRes - 1 - column) + 0.5f) / n) / n);
+	case AA_JITTERED:{
+		unsigned int h = hashUint((unsigned int)x + hashUint((unsigned int)y + hashUint((unsigned int)i)));
+		float jitterX = (float)(h >> 8) / 16777216.f;
+		float jitterY = (float)(hashUint(h) >> 8) / 16777216.f;
+		return glm::vec2(((float)column + jitterX) / n, ((float)row + jitterY) / n);
+	}
+	default:
+		return glm::vec2(((float)column + 0.5f) / n, ((float)row + 0.5f) / n);
+	}
+}
+// sample i of the aaRes by aaRes pattern
+static glm::vec4 patternSample(const Image& source, const RenderParams& params, int aaRes, int i, int x, int y, int width, int height) {
+	glm::vec2 offset = aaOffset(params.aaPattern, aaRes, i, x, y);
+	return renderPixel(source, params, glm::vec2(((float)x + offset.x) / (float)width, ((float)y + offset.y) / (float)height));
+}
+static glm::vec4 supersamplePixel(const Image& source, const RenderParams& params, int x, int y, int width, int height) {
+	int n = params.aaRes;
+	glm::vec4 sum = glm::vec4(0.f);
+	if (!params.aaAdaptive || n <= 2) {
+		for (int i = 0; i < n * n; i++) sum += patternSample(source, params, n, i, x, y, width, height);
+		return sum / (float)(n * n);
+	}
+
+	// the pattern's four corner samples first, flat areas stop there and edges add the rest, so each sample counts once
+	int last = n * n - 1;
+	int corners[4] = {0, n - 1, last - (n - 1), last};
+	glm::vec4 lo, hi;
+	for (int k = 0; k < 4; k++) {
+		glm::vec4 color = patternSample(source, params, n, corners[k], x, y, width, height);
+		sum += color;
+		lo = k == 0 ? color : glm::min(lo, color);
+		hi = k == 0 ? color : glm::max(hi, color);
+	}
+	glm::vec4 range = hi - lo;
+	if (max(max(range.r, range.g), max(range.b, range.a)) <= params.aaThreshold) return sum / 4.f;
+	for (int i = 1; i < last; i++) {
+		if (i != corners[1] && i != corners[2]) sum += patternSample(source, params, n, i, x, y, width, height);
+	}
+	return sum / (float)(n * n);
+}
+
+static int quantize(float v) {
+	return min(max((int)(v * 255.f + 0.5f), 0), 255);
+}
+// bin of a 16 bin histogram holding rank k, k becomes the rank inside that bin
+static int rankBin(const int* histogram, int& k) {
+	for (int i = 0; i < 15; i++) {
+		if (k < histogram[i]) return i;
+		k -= histogram[i];
+	}
+	return 15;
+}
+// same radix select as percentileCells in fragment.fsh: the high nibble histogram finds the bin holding the rank,
+// a second pass over the low nibbles of that bin finds the value, nothing grows with the number of cells
+// the result is in 0..255 levels
+static glm::vec3 percentileLevels(const glm::vec4* samples, int cells, float p) {
+	int high[3][16] = {};
+	int count = 0;
+	for (int i = 0; i < cells; i++) {
+		if (samples[i].a < 0.5f) continue;
+		for (int c = 0; c < 3; c++) high[c][quantize(samples[i][c]) >> 4]++;
+		count++;
+	}
+	if (count == 0) return glm::vec3(0.f);
+	float rank = p * (float)(count - 1);
+	int k0 = (int)floor(rank), k1 = (int)ceil(rank);
+
+	glm::vec3 v0, v1;
+	for (int c = 0; c < 3; c++) {
+		int rank0 = k0, rank1 = k1;
+		int bin0 = rankBin(high[c], rank0), bin1 = rankBin(high[c], rank1);
+		int low0[16] = {}, low1[16] = {};
+		for (int i = 0; i < cells; i++) {
+			if (samples[i].a < 0.5f) continue;
+			int q = quantize(samples[i][c]);
+			if (q >> 4 == bin0) low0[q & 15]++;
+			if (q >> 4 == bin1) low1[q & 15]++;
+		}
+		v0[c] = (float)(bin0 * 16 + rankBin(low0, rank0));
+		v1[c] = (float)(bin1 * 16 + rankBin(low1, rank1));
+	}
+	return glm::mix(v0, v1, rank - (float)k0);
+}
+static glm::vec3 percentileSamples(const glm::vec4* samples, int cells, float p) {
+	return percentileLevels(samples, cells, p) / 255.f;
+}
+// trimmedMeanCells in fragment.fsh, the cells are compared to the quartiles as 8 bit levels like the percentile
+static glm::vec3 trimmedMeanSamples(const glm::vec4* samples, int cells) {
+	glm::vec3 lo = percentileLevels(samples, cells, 0.25f), hi = percentileLevels(samples, cells, 0.75f);
+	glm::vec3 sum = glm::vec3(0.f), count = glm::vec3(0.f);
+	for (int i = 0; i < cells; i++) {
+		if (samples[i].a < 0.5f) continue;
+		for (int c = 0; c < 3; c++) {
+			float level = (float)quantize(samples[i][c]);
+			if (level < lo[c] || level > hi[c]) continue;
+			sum[c] += samples[i][c];
+			count[c] += 1.f;
+		}
+	}
+	return sum / glm::max(count, 1.f);
+}
+
+struct CellStats {
+	glm::vec3 mean = glm::vec3(0.f);
+	glm::vec3 variance = glm::vec3(0.f);
+	glm::vec3 mad = glm::vec3(0.f); // mean absolute deviation from the mean
+};
+// welford like cellStats in fragment.fsh, including the sqrt(2/pi) * stddev mad past howman cells
+static CellStats cellStats(const glm::vec4* samples, int cells) {
+	CellStats stats;
+	float count = 0.f;
+	glm::vec3 mean = glm::vec3(0.f), squaredDeviations = glm::vec3(0.f);
+	for (int i = 0; i < cells; i++) {
+		if (samples[i].a < 0.5f) continue;
+		count += 1.f;
+		glm::vec3 delta = glm::vec3(samples[i]) - mean;
+		mean += delta / count;
+		squaredDeviations += delta * (glm::vec3(samples[i]) - mean);
+	}
+	if (count == 0.f) return stats;
+	stats.mean = mean;
+	stats.variance = squaredDeviations / count;
+	if (cells <= howman) {
+		for (int i = 0; i < cells; i++) {
+			if (samples[i].a >= 0.5f) stats.mad += glm::abs(glm::vec3(samples[i]) - mean);
+		}
+		stats.mad /= count;
+	} else {
+		stats.mad = glm::sqrt(stats.variance) * 0.7978846f; // sqrt(2 / pi)
+	}
+	return stats;
+}
+
+// one combine mode over cells that were already fetched, samples[i] is the texel at sourceUvs[i]
+glm::vec4 combineFetched(const Image& source, const RenderParams& params, int combineMode, const glm::vec2* sourceUvs, vector<glm::vec4>& samples) {
+	int cells = params.gridX * params.gridY;
+	if (combineMode == 2) return glm::vec4(glm::vec3(fetchPixel(source, params, sourceUvs[params.gridNumber])), 1.f); // single
+	glm::vec3 currentColor = glm::vec3(0.f);
+
+	switch (combineMode) {
+	case 0:{ // mean
+		float howmany = 0.f;
+		for (int i = 0; i < cells; i++) {
+			currentColor += glm::vec3(samples[i]) * samples[i].a;
+			howmany += samples[i].a;
+		}
+		if (howmany > 0.f) currentColor /= howmany;
+		break;
+	}
+	case 1:{ // median
+		thread_local vector<float> red, green, blue;
+		red.clear();
+		green.clear();
+		blue.clear();
+		for (int i = 0; i < cells; i++) {
+			if (samples[i].a > 0.5f) {
+				red.push_back(samples[i].r);
+				green.push_back(samples[i].g);
+				blue.push_back(samples[i].b);
+			}
+		}
+		currentColor = glm::vec3(getMedian(red), getMedian(green), getMedian(blue));
+		break;
+	}
+	case 3:{ // color palette
+		int currentColors[howmanycolors] = {0, 0, 0};
+		for (int i = 0; i < cells; i++) {
+			glm::vec3 pixelColor = glm::vec3(samples[i]);
+
+			//get closest color
+			int closestColor = 0;
+			float closestColorDistance = 1000.f;
+			for (int j = 0; j < howmanycolors; j++) {
+				float dist = glm::distance(pixelColor, palette[j]);
+				if (dist < closestColorDistance) {
+					closestColorDistance = dist;
+					closestColor = j;
+				}
+			}
+			currentColors[closestColor]++;
+		}
+		//get mode
+		int mostColorCount = 0;
+		for (int i = 0; i < howmanycolors; i++) {
+			if (currentColors[i] > mostColorCount) {
+				currentColor = palette[i];
+				mostColorCount = currentColors[i];
+			}
+		}
+		break;
+	}
+	case 4: // mad
+	case 7: // standard deviation
+	case 8:{ // coefficient of variation
+		const float multiplier = 10.f;
+		CellStats stats = cellStats(samples.data(), cells);
+		if (combineMode == 4) currentColor = stats.mad * multiplier;
+		else if (combineMode == 7) currentColor = glm::sqrt(stats.variance) * multiplier;
+		else currentColor = glm::sqrt(stats.variance) / glm::max(stats.mean, 1.f / 255.f); // already relative, no multiplier
+		break;
+	}
+	case 5:{ // voronoi
+		glm::vec2 rasterResolution = glm::vec2((float)source.width, (float)source.height);
+		float closestPixelSquareDistance = 0.f;
+		int closestPixelGridIndex = -1;
+		for (int i = 0; i < cells; i++) {
+			glm::vec2 roundedPixelUv = (glm::floor(sourceUvs[i] * rasterResolution) + 0.5f) / rasterResolution;
+			glm::vec2 offset = sourceUvs[i] - roundedPixelUv;
+			float squareDistance = glm::dot(offset, offset);
+			if (squareDistance < closestPixelSquareDistance || closestPixelGridIndex == -1) {
+				closestPixelSquareDistance = squareDistance;
+				closestPixelGridIndex = i;
+			}
+		}
+		currentColor = glm::vec3(fetchPixel(source, params, sourceUvs[closestPixelGridIndex]));
+		break;
+	}
+	case 6: // percentile
+		currentColor = percentileSamples(samples.data(), cells, params.percentile);
+		break;
+	case 9: // trimmed mean
+		currentColor = trimmedMeanSamples(samples.data(), cells);
+		break;
+	}
+	return glm::vec4(currentColor, 1.f);
+}
+// sourceUvs holds the already warped uv of every grid cell
+static glm::vec4 combineSamples(const Image& source, const RenderParams& params, const glm::vec2* sourceUvs) {
+	// fetch each cell once, voronoi and single only fetch the cell they pick
+	thread_local vector<glm::vec4> samples;
+	int cells = params.gridX * params.gridY;
+	samples.resize(cells);
+	if (params.combineMode != 2 && params.combineMode != 5) {
+		for (int i = 0; i < cells; i++) samples[i] = fetchPixel(source, params, sourceUvs[i]);
+	}
+	return combineFetched(source, params, params.combineMode, sourceUvs, samples);
+}
+
+bool WarpKey::operator==(const WarpKey& o) const {
+	return a == o.a && b == o.b && c == o.c && d == o.d && ratio == o.ratio && iterations == o.iterations && trans == o.trans &&
+		showTransform == o.showTransform && combineMosaic == o.combineMosaic && lensTable == o.lensTable &&
+		lensModel == o.lensModel && divisionK == o.divisionK && inverseCoefficients == o.inverseCoefficients && gridX == o.gridX && gridY == o.gridY &&
+		aabb.l == o.aabb.l && aabb.r == o.aabb.r && aabb.b == o.aabb.b && aabb.t == o.aabb.t && width == o.width && height == o.height;
+}
+WarpKey warpKey(const RenderParams& params, int width, int height) {
+	WarpKey key;
+	key.a = params.a;
+	key.b = params.b;
+	key.c = params.c;
+	key.d = params.d;
+	key.ratio = params.ratio;
+	key.iterations = params.binarySearchIterations;
+	key.trans = params.showTransform ? params.trans : glm::mat3(1.f); // trans doesn't matter when it isn't shown
+	key.showTransform = params.showTransform;
+	key.combineMosaic = params.combineMosaic;
+	key.lensTable = usesLensTable(params);
+	key.lensModel = params.lens.type;
+	key.divisionK = params.lens.type == LENS_DIVISION ? params.lens.k : 0.f;
+	key.inverseCoefficients = params.lens.type == LENS_INVERSE_POLYNOMIAL ? params.lens.inverse : glm::vec4(0.f);
+	key.gridX = params.combineMosaic ? params.gridX : 1;
+	key.gridY = params.combineMosaic ? params.gridY : 1;
+	key.aabb = params.aabb;
+	key.width = width;
+	key.height = height;
+	return key;
+}
+
+void parallelFor(int count, int threads, const function<void(int)>& work) {
+	if (threads <= 0) threads = max(1, (int)thread::hardware_concurrency());
+	threads = min(threads, max(1, count));
+
+	atomic<int> next{0};
+	auto worker = [&]() {
+		for (int i = next++; i < count; i = next++) work(i);
+	};
+	vector<thread> pool;
+	for (int i = 1; i < threads; i++) pool.emplace_back(worker);
+	worker();
+	for (thread& t : pool) t.join();
+}
+
+void buildWarpMap(const RenderParams& params, int width, int height, WarpMap& map, int threads) {
+	map.key = warpKey(params, width, height);
+	map.cells = map.key.gridX * map.key.gridY;
+	map.uvs.resize((size_t)width * (size_t)height * (size_t)map.cells);
+	parallelFor(height, threads, [&](int y) {
+		glm::vec2* row = &map.uvs[(size_t)y * (size_t)width * (size_t)map.cells];
+		for (int x = 0; x < width; x++) {
+			glm::vec2 uv = viewUv(params, glm::vec2(((float)x + 0.5f) / (float)width, ((float)y + 0.5f) / (float)height));
+			for (int i = 0; i < map.cells; i++) row[x * map.cells + i] = params.combineMosaic ? cellUv(uv, i, params) : uv;
+		}
+		transformUvs(row, width * map.cells, params);
+	});
+}
+
+void writePixel(Image& output, int x, int y, glm::vec4 color) {
+	color = glm::clamp(color, 0.f, 1.f);
+	color = glm::vec4(glm::vec3(color) * color.a, color.a * color.a); // same as the src alpha blend onto the cleared framebuffer
+	unsigned char* p = &output.pixels[((size_t)y * (size_t)output.width + (size_t)x) * 4];
+	for (int i = 0; i < 4; i++) p[i] = (unsigned char)(color[i] * 255.f + 0.5f);
+}
+
+void renderGatherModes(const Image& source, const RenderParams& params, Image* outputs, int threads, const WarpMap* warpMap) {
+	int width = outputs[0].width, height = outputs[0].height;
+	for (int i = 1; i < gatherModeCount; i++) outputs[i].resize(width, height);
+	if (warpMap && !(warpMap->key == warpKey(params, width, height))) warpMap = nullptr;
+	int cells = params.gridX * params.gridY;
+
+	parallelFor(height, threads, [&](int y) {
+		thread_local vector<glm::vec2> sourceUvs;
+		thread_local vector<glm::vec4> samples;
+		sourceUvs.resize(cells);
+		samples.resize(cells);
+		for (int x = 0; x < width; x++) {
+			const glm::vec2* uvs = sourceUvs.data();
+			if (warpMap) {
+				uvs = &warpMap->uvs[((size_t)y * (size_t)width + (size_t)x) * (size_t)cells];
+			} else {
+				glm::vec2 uv = viewUv(params, glm::vec2(((float)x + 0.5f) / (float)width, ((float)y + 0.5f) / (float)height));
+				for (int i = 0; i < cells; i++) sourceUvs[i] = cellUv(uv, i, params);
+				transformUvs(sourceUvs.data(), cells, params);
+			}
+			for (int i = 0; i < cells; i++) samples[i] = fetchPixel(source, params, uvs[i]);
+			for (int i = 0; i < gatherModeCount; i++) writePixel(outputs[i], x, y, combineFetched(source, params, gatherModes[i], uvs, samples));
+		}
+	});
+	for (int i = 0; i < gatherModeCount; i++) outputs[i].touch();
+}
+
+void renderImage(const Image& source, const RenderParams& params, Image& output, int threads, const WarpMap* warpMap) {
+	bool supersampled = params.aaRes > 1;
+	if (warpMap && (supersampled || !(warpMap->key == warpKey(params, output.width, output.height)))) warpMap = nullptr; // the map only has pixel centers
+
+	const int tileSize = 32;
+	int tilesX = (output.width + tileSize - 1) / tileSize;
+	int tilesY = (output.height + tileSize - 1) / tileSize;
+	parallelFor(tilesX * tilesY, threads, [&](int tile) {
+		int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+		int x1 = min(x0 + tileSize, output.width), y1 = min(y0 + tileSize, output.height);
+		for (int y = y0; y < y1; y++) {
+			// without the mosaic there's one warp per pixel, so batch the whole tile row through the lens kernel
+			glm::vec2 rowUvs[tileSize];
+			if (!params.combineMosaic && !warpMap && !supersampled) {
+				for (int x = x0; x < x1; x++) {
+					rowUvs[x - x0] = viewUv(params, glm::vec2(((float)x + 0.5f) / (float)output.width, ((float)y + 0.5f) / (float)output.height));
+				}
+				transformUvs(rowUvs, x1 - x0, params);
+			}
+			for (int x = x0; x < x1; x++) {
+				glm::vec4 color;
+				if (supersampled) {
+					color = supersamplePixel(source, params, x, y, output.width, output.height);
+				} else if (warpMap) {
+					const glm::vec2* sourceUvs = &warpMap->uvs[((size_t)y * (size_t)output.width + (size_t)x) * (size_t)warpMap->cells];
+					color = params.combineMosaic ? combineSamples(source, params, sourceUvs) : fetchPixel(source, params, sourceUvs[0]);
+				} else if (params.combineMosaic) {
+					color = renderPixel(source, params, glm::vec2(((float)x + 0.5f) / (float)output.width, ((float)y + 0.5f) / (float)output.height));
+				} else {
+					color = fetchPixel(source, params, rowUvs[x - x0]);
+				}
+				writePixel(output, x, y, color);
+			}
+		}
+	});
+	output.touch();
+}
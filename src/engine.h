@@ -0,0 +1,181 @@
+#pragma once
+// cpu version of the raster pipeline in shaders/fragment.fsh, no window or gl context needed
+
+#include <vector>
+#include <utility>
+#include <functional>
+#include <glm/glm.hpp>
+
+struct AABB {
+	float l, r, b, t;
+};
+
+// rgba8 image stored bottom row first, same as the gl textures
+class Image {
+public:
+	int width = 0, height = 0;
+	std::vector<unsigned char> pixels;
+	unsigned long long id = 0; // new on every load and resize, caches key on it, call touch() after writing pixels in place
+
+	Image() {}
+	Image(int w, int h) {
+		resize(w, h);
+	}
+	void resize(int w, int h) {
+		width = w;
+		height = h;
+		pixels.assign((size_t)w * (size_t)h * 4, 0);
+		touch();
+	}
+	void touch();
+	bool load(const char* path);
+	bool savePng(const char* path) const;
+};
+
+// inverseLensDistortion sampled densely on [0, maxR] for one set of coefficients, linearly interpolated in between
+class LensTable {
+public:
+	static const int rowWidth = 1024; // the gl texture is rowWidth wide and size / rowWidth tall
+	float a = 0.f, b = 0.f, c = 0.f, d = 0.f, maxR = 0.f;
+	int iterations = -1;
+	std::vector<float> values;
+	// largest difference from the newton solve at 3 points inside every interval, an estimate and not a bound:
+	// a sharper bend between two probes can still be off by more
+	float sampledError = 0.f;
+	bool valid = false; // false when even the biggest table has sampledError over the tolerance, use newton then
+
+	bool matches(float a, float b, float c, float d, int iterations, float maxR) const;
+	void build(float a, float b, float c, float d, int iterations, float maxR, float tolerance = 1e-5f);
+	float lookup(float distortedR) const; // newton past maxR
+};
+// radius the table has to cover for a ratio, a bit past the corners so zooming out a little still hits it
+float lensTableRange(float ratio);
+
+enum LensModelType {
+	LENS_POLYNOMIAL, // a,b,c,d map source radius to output radius, newton inverts it per sample
+	LENS_DIVISION, // source radius = r / (1 + k r^2), both directions closed form
+	LENS_INVERSE_POLYNOMIAL // source radius = r (e0 + e1 r + e2 r^2 + e3 r^3) fitted to a,b,c,d, one evaluation per sample
+};
+struct LensModel {
+	int type = LENS_POLYNOMIAL;
+	float k = 0.f;
+	glm::vec4 inverse = glm::vec4(1.f, 0.f, 0.f, 0.f);
+	float maxError = 0.f; // biggest difference from the newton inverse of a,b,c,d after fitting
+};
+extern const char* lensModelNames[3];
+// least squares fit of a model to the newton inverse of the polynomial over [0, maxR]
+LensModel fitLensModel(int type, float a, float b, float c, float d, int iterations, float maxR);
+// what fitLensModel puts in maxError, again for coefficients changed by hand
+float lensModelError(const LensModel& model, float a, float b, float c, float d, int iterations, float maxR);
+// radius the lens functions return where the model has no answer, far enough out that the pixel is transparent
+const float lensOutside = 1e4f;
+
+enum AAPattern {
+	AA_ORDERED, // n by n grid of pixel sub-centers
+	AA_ROTATED, // n by n grid sheared so no two samples share a row or column, better on near horizontal/vertical edges
+	AA_JITTERED // one random spot inside each of the n by n strata, hashed from the pixel so renders repeat
+};
+extern const char* aaPatternNames[3];
+// sample i of an aaRes by aaRes pattern for pixel x,y, as an offset inside the pixel, same as aaOffset in fragment.fsh
+glm::vec2 aaOffset(int pattern, int aaRes, int i, int x, int y);
+
+struct RenderParams {
+	float a = 0.f, b = 0.f, c = 0.f, d = 1.f;
+	float ratio = 1.5f;
+	int binarySearchIterations = 10;
+	glm::mat3 trans = glm::mat3(1.f);
+	bool showTransform = false;
+	bool combineMosaic = false;
+	int combineMode = 0;
+	float percentile = 0.5f; // combineMode 6, 0 picks the darkest cell and 1 the brightest per channel
+	int gridX = 3, gridY = 3;
+	int gridNumber = 0;
+	AABB aabb = {0.f, 1.f, 0.f, 1.f};
+	bool nearest = true;
+	LensModel lens;
+	const LensTable* lensTable = nullptr; // used instead of newton when set and it matches the coefficients
+	int aaRes = 1; // aaRes * aaRes samples per pixel
+	int aaPattern = AA_ORDERED;
+	bool aaAdaptive = false; // 2x2 samples first, the full pattern only where they differ by more than aaThreshold
+	float aaThreshold = 1.f / 32.f;
+};
+
+float lensInverse(float r, const RenderParams& params); // output radius to source radius for whichever lens model is picked
+float lensForward(float r, const RenderParams& params); // source radius to output radius, what the overlays need, lensOutside when none maps to r
+
+float lensDistortion(float r, float a, float b, float c, float d);
+float inverseLensDistortion(float distortedR, float a, float b, float c, float d, int iterations);
+// same as calling inverseLensDistortion n times but 4 or 8 at once with simd, results are bit identical
+void inverseLensDistortionBatch(const float* distortedR, float* r, int n, float a, float b, float c, float d, int iterations);
+glm::mat3 transform2d(float x1, float y1, float x2, float y2, float x3, float y3, float x4, float y4);
+
+// batcher's odd-even merge sort as compare/swap pairs, and the same pruned to the comparators that reach outputs
+std::vector<std::pair<int, int>> sortingNetwork(int n);
+std::vector<std::pair<int, int>> selectionNetwork(int n, const std::vector<int>& outputs);
+
+glm::vec2 transformUv(glm::vec2 uv, const RenderParams& params);
+void transformUvs(glm::vec2* uvs, int n, const RenderParams& params); // in place, uses the batched lens kernel
+glm::vec4 samplePixel(const Image& source, glm::vec2 uv, bool nearest);
+glm::vec4 renderPixel(const Image& source, const RenderParams& params, glm::vec2 texcoord);
+// the pieces renderImage is built from, for code that keeps samples around between renders
+glm::vec4 fetchPixel(const Image& source, const RenderParams& params, glm::vec2 sourceUv); // samplePixel with alpha cut to 0 or 1
+void cellSourceUvs(const RenderParams& params, int x, int y, int width, int height, glm::vec2* uvs); // every cell at the center of pixel x,y
+// one combine mode over cells already fetched into samples, sourceUvs is only read by single and voronoi
+glm::vec4 combineFetched(const Image& source, const RenderParams& params, int combineMode, const glm::vec2* sourceUvs, std::vector<glm::vec4>& samples);
+void writePixel(Image& output, int x, int y, glm::vec4 color); // clamps and blends like the gl framebuffer, then stores 8 bit
+const int paletteSize = 3;
+extern const glm::vec3 palette[paletteSize]; // what the mode combine snaps cells to
+const int maxExactMadCells = 48; // past this mad is estimated from the stddev, howman in fragment.fsh
+// runs work(i) for i in [0, count) spread over threads, 0 threads means every core
+void parallelFor(int count, int threads, const std::function<void(int)>& work);
+
+// everything the warped source uvs depend on, the combine mode, grid number and filter don't change them
+struct WarpKey {
+	float a, b, c, d, ratio;
+	int iterations;
+	glm::mat3 trans; // follows transformQuad
+	bool showTransform, combineMosaic, lensTable;
+	int lensModel;
+	float divisionK;
+	glm::vec4 inverseCoefficients;
+	int gridX, gridY;
+	AABB aabb;
+	int width, height;
+	bool operator==(const WarpKey& other) const;
+};
+WarpKey warpKey(const RenderParams& params, int width, int height);
+
+// warped source uv of every output pixel and grid cell, stored [y][x][cell]
+class WarpMap {
+public:
+	WarpKey key;
+	int cells = 0;
+	std::vector<glm::vec2> uvs;
+	size_t bytes() const {
+		return uvs.size() * sizeof(glm::vec2);
+	}
+};
+void buildWarpMap(const RenderParams& params, int width, int height, WarpMap& map, int threads = 0);
+
+// renders output.width x output.height pixels split into tiles over every core, threads = 0 means all of them
+// warpMap is used instead of warping when its key matches and there's no supersampling
+void renderImage(const Image& source, const RenderParams& params, Image& output, int threads = 0, const WarpMap* warpMap = nullptr);
+
+// what the combine modes are called in file names, indexed by combineMode
+extern const char* combineModeNames[10];
+// the modes renderGatherModes makes at once: mean, median, mode, mad, voronoi
+const int gatherModeCount = 5;
+extern const int gatherModes[gatherModeCount];
+// every gatherModes combine of the mosaic from one warp and one fetch per cell, outputs[i] gets mode gatherModes[i]
+// all outputs take the size of outputs[0], pixel centers only so aaRes is ignored
+void renderGatherModes(const Image& source, const RenderParams& params, Image* outputs, int threads = 0, const WarpMap* warpMap = nullptr);
+
+// everything the batch cli needs to reproduce a render, written by the editor's "Save recipe" button
+struct Recipe {
+	RenderParams params;
+	glm::vec2 transformQuad[4] = {{0.f, 0.f}, {0.f, 1.f}, {1.f, 1.f}, {1.f, 0.f}};
+	int width = 640, height = 480; // 0 means use the source image size
+	bool useLensTable = true;
+};
+bool loadRecipe(const char* path, Recipe& recipe);
+bool saveRecipe(const char* path, const Recipe& recipe);
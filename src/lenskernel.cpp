@@ -0,0 +1,125 @@
+// batched inverseLensDistortion, 8 radii per step with avx2, 4 with sse2/neon
+// every lane does exactly the same float operations in the same order as the scalar loop
+// (the engine is built with -ffp-contract=off so nothing gets fused), so results are bit identical
+#include "engine.h"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define LENS_SSE2 1
+#if defined(__GNUC__) || defined(__clang__)
+#define LENS_AVX2 1
+#endif
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define LENS_NEON 1
+#endif
+
+using namespace std;
+
+static void inverseLensDistortionScalar(const float* distortedR, float* out, int n, float a, float b, float c, float d, int iterations) {
+	for (int i = 0; i < n; i++) out[i] = inverseLensDistortion(distortedR[i], a, b, c, d, iterations);
+}
+
+#ifdef LENS_SSE2
+static void inverseLensDistortionSse2(const float* distortedR, float* out, int n, float a, float b, float c, float d, int iterations) {
+	const __m128 va = _mm_set1_ps(a), vb = _mm_set1_ps(b), vc = _mm_set1_ps(c), vd = _mm_set1_ps(d);
+	const __m128 a4 = _mm_set1_ps(4.f * a), b3 = _mm_set1_ps(3.f * b), c2 = _mm_set1_ps(2.f * c);
+	const __m128 signMask = _mm_set1_ps(-0.f), epsilon = _mm_set1_ps(1e-6f), zero = _mm_setzero_ps();
+	const __m128 allLanes = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128 target = _mm_loadu_ps(distortedR + i);
+		__m128 r = target;
+		__m128 active = allLanes;
+		for (int j = 0; j < iterations; j++) {
+			__m128 rr = _mm_mul_ps(r, r);
+			__m128 poly = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(va, r), r), _mm_mul_ps(vb, r)), vc);
+			__m128 f = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(poly, r), r), _mm_mul_ps(vd, r)), target);
+			__m128 derivative = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rr, _mm_add_ps(_mm_mul_ps(a4, r), b3)), _mm_mul_ps(c2, r)), vd);
+
+			active = _mm_andnot_ps(_mm_cmplt_ps(_mm_andnot_ps(signMask, derivative), epsilon), active); // derivative too flat, lane stops
+			__m128 next = _mm_sub_ps(r, _mm_div_ps(f, derivative));
+			r = _mm_or_ps(_mm_and_ps(active, next), _mm_andnot_ps(active, r));
+			active = _mm_andnot_ps(_mm_cmpeq_ps(f, zero), active); // converged exactly, more steps change nothing
+			if (_mm_movemask_ps(active) == 0) break;
+		}
+		_mm_storeu_ps(out + i, r);
+	}
+	inverseLensDistortionScalar(distortedR + i, out + i, n - i, a, b, c, d, iterations);
+}
+#endif
+
+#ifdef LENS_AVX2
+__attribute__((target("avx2")))
+static void inverseLensDistortionAvx2(const float* distortedR, float* out, int n, float a, float b, float c, float d, int iterations) {
+	const __m256 va = _mm256_set1_ps(a), vb = _mm256_set1_ps(b), vc = _mm256_set1_ps(c), vd = _mm256_set1_ps(d);
+	const __m256 a4 = _mm256_set1_ps(4.f * a), b3 = _mm256_set1_ps(3.f * b), c2 = _mm256_set1_ps(2.f * c);
+	const __m256 signMask = _mm256_set1_ps(-0.f), epsilon = _mm256_set1_ps(1e-6f), zero = _mm256_setzero_ps();
+	const __m256 allLanes = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256 target = _mm256_loadu_ps(distortedR + i);
+		__m256 r = target;
+		__m256 active = allLanes;
+		for (int j = 0; j < iterations; j++) {
+			__m256 rr = _mm256_mul_ps(r, r);
+			__m256 poly = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(va, r), r), _mm256_mul_ps(vb, r)), vc);
+			__m256 f = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(poly, r), r), _mm256_mul_ps(vd, r)), target);
+			__m256 derivative = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rr, _mm256_add_ps(_mm256_mul_ps(a4, r), b3)), _mm256_mul_ps(c2, r)), vd);
+
+			active = _mm256_andnot_ps(_mm256_cmp_ps(_mm256_andnot_ps(signMask, derivative), epsilon, _CMP_LT_OQ), active);
+			__m256 next = _mm256_sub_ps(r, _mm256_div_ps(f, derivative));
+			r = _mm256_blendv_ps(r, next, active);
+			active = _mm256_andnot_ps(_mm256_cmp_ps(f, zero, _CMP_EQ_OQ), active);
+			if (_mm256_movemask_ps(active) == 0) break;
+		}
+		_mm256_storeu_ps(out + i, r);
+	}
+	inverseLensDistortionSse2(distortedR + i, out + i, n - i, a, b, c, d, iterations);
+}
+#endif
+
+#ifdef LENS_NEON
+static void inverseLensDistortionNeon(const float* distortedR, float* out, int n, float a, float b, float c, float d, int iterations) {
+	const float32x4_t va = vdupq_n_f32(a), vb = vdupq_n_f32(b), vc = vdupq_n_f32(c), vd = vdupq_n_f32(d);
+	const float32x4_t a4 = vdupq_n_f32(4.f * a), b3 = vdupq_n_f32(3.f * b), c2 = vdupq_n_f32(2.f * c);
+	const float32x4_t epsilon = vdupq_n_f32(1e-6f), zero = vdupq_n_f32(0.f);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const float32x4_t target = vld1q_f32(distortedR + i);
+		float32x4_t r = target;
+		uint32x4_t active = vdupq_n_u32(0xffffffffu);
+		for (int j = 0; j < iterations; j++) {
+			// vmulq + vaddq on purpose, vmlaq would fuse on aarch64
+			float32x4_t rr = vmulq_f32(r, r);
+			float32x4_t poly = vaddq_f32(vaddq_f32(vmulq_f32(vmulq_f32(va, r), r), vmulq_f32(vb, r)), vc);
+			float32x4_t f = vsubq_f32(vaddq_f32(vmulq_f32(vmulq_f32(poly, r), r), vmulq_f32(vd, r)), target);
+			float32x4_t derivative = vaddq_f32(vaddq_f32(vmulq_f32(rr, vaddq_f32(vmulq_f32(a4, r), b3)), vmulq_f32(c2, r)), vd);
+
+			active = vbicq_u32(active, vcltq_f32(vabsq_f32(derivative), epsilon));
+			float32x4_t next = vsubq_f32(r, vdivq_f32(f, derivative));
+			r = vbslq_f32(active, next, r);
+			active = vbicq_u32(active, vceqq_f32(f, zero));
+			if (vmaxvq_u32(active) == 0) break;
+		}
+		vst1q_f32(out + i, r);
+	}
+	inverseLensDistortionScalar(distortedR + i, out + i, n - i, a, b, c, d, iterations);
+}
+#endif
+
+void inverseLensDistortionBatch(const float* distortedR, float* r, int n, float a, float b, float c, float d, int iterations) {
+#ifdef LENS_AVX2
+	static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+	if (hasAvx2) return inverseLensDistortionAvx2(distortedR, r, n, a, b, c, d, iterations);
+#endif
+#if defined(LENS_SSE2)
+	inverseLensDistortionSse2(distortedR, r, n, a, b, c, d, iterations);
+#elif defined(LENS_NEON)
+	inverseLensDistortionNeon(distortedR, r, n, a, b, c, d, iterations);
+#else
+	inverseLensDistortionScalar(distortedR, r, n, a, b, c, d, iterations);
+#endif
+}
@@ -4,13 +4,20 @@
 #include <sstream>
 #include <vector>
 #include <memory>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 #include <glad/glad.h>
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
-#define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
-#define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb/stb_image_write.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -18,6 +25,8 @@
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
+#include "engine.h"
+#include "cache.h"
 
 using namespace std;
 
@@ -42,35 +51,311 @@ class Texture {
 public:
 	int width, height, numChannels;
 	unsigned int id, slot;
+	string path; // what it was loaded from, empty for the placeholder
+	int levels = 1, level = 0; // mip levels built and the one sampled, 0 is full resolution
+	static size_t residentBytes; // every texture alive, cached or not
+
+	// one transparent pixel until the real image is loaded, so the window can come up before anything is decoded
+	Texture() {
+		create();
+		width = height = 1;
+		numChannels = 4;
+		unsigned char pixel[4] = {0, 0, 0, 0};
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixel);
+		setBytes(4);
+	}
 	Texture(const char* path) {
+		create();
+		load(path);
+	}
+	// storage only, the pixels come later with glTexSubImage2D
+	Texture(int width, int height) : width(width), height(height), numChannels(4) {
+		create();
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		setBytes((size_t)width * (size_t)height * 4);
+	}
+	// owned through shared_ptr only, the gl texture goes with the last owner
+	Texture(const Texture&) = delete;
+	Texture& operator=(const Texture&) = delete;
+	~Texture() {
+		glDeleteTextures(1, &id);
+		residentBytes -= bytes;
+	}
+	size_t size() const {
+		return bytes;
+	}
+	glm::ivec2 levelSize(int l) const {
+		return glm::max(glm::ivec2(width >> l, height >> l), 1);
+	}
+	glm::ivec2 sampledSize() const {
+		return levelSize(level);
+	}
+	// after the pixels are in, zoomed out previews sample a smaller level instead of aliasing the full one
+	void buildMips() {
+		glBindTexture(GL_TEXTURE_2D, id);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		size_t stored = 0;
+		for (levels = 0; (max(width, height) >> levels) > 0; levels++) stored += (size_t)levelSize(levels).x * (size_t)levelSize(levels).y * 4;
+		setBytes(stored);
+	}
+	// base and max level both at the one sampled, the shader then sees it as the whole texture
+	void useLevel(int next) {
+		next = glm::clamp(next, 0, levels - 1);
+		if (next == level) return;
+		level = next;
+		glActiveTexture(GL_TEXTURE0 + slot);
+		glBindTexture(GL_TEXTURE_2D, id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	// replaces the pixels in place, everything holding this texture sees the new image
+	void load(const char* path) {
+		this->path = path;
 		stbi_set_flip_vertically_on_load(true);
-		glGenTextures(1, &id);
 		glBindTexture(GL_TEXTURE_2D, id);
-		float borderColor[4] = {0.f, 0.f, 0.f, 0.f};
-		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR_NV, borderColor);
-
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER_NV);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER_NV);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 		unsigned char *data = stbi_load(path, &width, &height, &numChannels, 0);
 		cout << "[INFO] Texture loaded: \"" << path << "\" color channels: " << numChannels << endl;
 		if (data) {
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, numChannels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, data);
+			setBytes((size_t)width * (size_t)height * 4);
 		} else {
 			cout << "[ERROR] failed to load \"" << path << "\"" << endl;
 		}
 		stbi_image_free(data);
 	}
+private:
+	size_t bytes = 0;
+
+	void setBytes(size_t stored) {
+		residentBytes += stored - bytes;
+		bytes = stored;
+	}
+	void create() {
+		glGenTextures(1, &id);
+		glBindTexture(GL_TEXTURE_2D, id);
+		float borderColor[4] = {0.f, 0.f, 0.f, 0.f};
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR_NV, borderColor);
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER_NV);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER_NV);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
 };
+size_t Texture::residentBytes = 0;
+// loaded images by path, dropping one again shows it without decoding, least recently used ones past the budget go
+// the one on screen stays alive through rasterTextures and the rasters even when it's evicted
+BudgetCache<string, Texture> textureCache((size_t)1024 << 20);
+const int uploadSlot = 15; // loads bind here so the texture units the frame uses stay as they are
+// dropped images are decoded on worker threads and uploaded a slice per frame through a pixel buffer,
+// so the current image stays up and the ui keeps running until the next one is complete
+class ImageLoader {
+public:
+	ImageLoader(int threads) {
+		for (int i = 0; i < threads; i++) workers.emplace_back([this] { work(); });
+	}
+	~ImageLoader() {
+		{
+			lock_guard<mutex> lock(jobsMutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (thread& worker : workers) worker.join();
+		if (pixelBuffer) glDeleteBuffers(1, &pixelBuffer);
+	}
+	void queue(const string& path) {
+		lock_guard<mutex> lock(jobsMutex);
+		for (const shared_ptr<Job>& job : jobs) {
+			if (job->path == path) return; // dropped again before it finished, one decode is enough
+		}
+		jobs.push_back(make_shared<Job>());
+		jobs.back()->path = path;
+		wake.notify_one();
+	}
+	// uploads up to budgetBytes more of the oldest image, returns its texture once all of it is there
+	// images come out in the order they were queued, ones that fail to decode are dropped
+	shared_ptr<Texture> step(size_t budgetBytes) {
+		shared_ptr<Job> job;
+		{
+			lock_guard<mutex> lock(jobsMutex);
+			bool dropped = false;
+			while (!jobs.empty() && jobs.front()->decoded && jobs.front()->image.pixels.empty()) {
+				jobs.pop_front();
+				dropped = true;
+			}
+			if (dropped) wake.notify_all();
+			if (jobs.empty() || !jobs.front()->decoded) return nullptr;
+			job = jobs.front();
+		}
+		const Image& image = job->image;
+		size_t stride = (size_t)image.width * 4;
+		int rows = (int)min((size_t)(image.height - uploadedRows), max(budgetBytes / stride, (size_t)1));
+		glActiveTexture(GL_TEXTURE0 + uploadSlot);
+		if (!uploading) { // allocating an 8k texture takes a frame on its own
+			uploading = make_shared<Texture>(image.width, image.height);
+			glActiveTexture(GL_TEXTURE0);
+			return nullptr;
+		}
+		glBindTexture(GL_TEXTURE_2D, uploading->id);
+		if (!pixelBuffer) glGenBuffers(1, &pixelBuffer);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, stride * rows, nullptr, GL_STREAM_DRAW); // fresh storage so the last slice doesn't have to finish first
+		void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, stride * rows, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (mapped) {
+			memcpy(mapped, &image.pixels[stride * uploadedRows], stride * rows);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, uploadedRows, image.width, rows, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		} else { // straight from memory then, the slice just isn't overlapped
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, uploadedRows, image.width, rows, GL_RGBA, GL_UNSIGNED_BYTE, &image.pixels[stride * uploadedRows]);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // everything else uploads from client memory
+		uploadedRows += rows;
+		if (uploadedRows == image.height) uploading->buildMips();
+		glActiveTexture(GL_TEXTURE0);
+		if (uploadedRows < image.height) return nullptr;
+		cout << "[INFO] Texture loaded: \"" << job->path << "\" " << image.width << "x" << image.height << endl;
+		shared_ptr<Texture> texture = move(uploading);
+		texture->path = job->path;
+		uploadedRows = 0;
+		lock_guard<mutex> lock(jobsMutex);
+		jobs.pop_front();
+		wake.notify_all(); // room for the next decode
+		return texture;
+	}
+	// images queued, decoding or uploading
+	int pending() {
+		lock_guard<mutex> lock(jobsMutex);
+		return (int)jobs.size();
+	}
+	// true while there's decoded pixels waiting, the frames have to keep coming to upload them
+	bool uploadReady() {
+		lock_guard<mutex> lock(jobsMutex);
+		return !jobs.empty() && jobs.front()->decoded;
+	}
+	float progress() {
+		lock_guard<mutex> lock(jobsMutex);
+		if (jobs.empty() || !jobs.front()->decoded || jobs.front()->image.height == 0) return 0.f;
+		return (float)uploadedRows / (float)jobs.front()->image.height;
+	}
+private:
+	struct Job {
+		string path;
+		Image image; // empty when decoding failed
+		bool taken = false, decoded = false;
+	};
+	static const int maxDecodedAhead = 2; // an 8k photo is almost 200mb decoded, so a dropped folder doesn't all sit in memory
+	deque<shared_ptr<Job>> jobs;
+	mutex jobsMutex;
+	condition_variable wake;
+	bool stopping = false;
+	vector<thread> workers;
+	shared_ptr<Texture> uploading;
+	int uploadedRows = 0;
+	unsigned int pixelBuffer = 0;
+
+	void work() {
+		stbi_set_flip_vertically_on_load_thread(false); // Image::load flips itself, the textures set the global flag
+		while (true) {
+			shared_ptr<Job> job;
+			{
+				unique_lock<mutex> lock(jobsMutex);
+				wake.wait(lock, [&] {
+					if (stopping) return true;
+					int ahead = 0; // taken and not uploaded yet, each one holds a whole rgba image
+					for (shared_ptr<Job>& queued : jobs) {
+						if (queued->taken) ahead++;
+						else return ahead < maxDecodedAhead;
+					}
+					return false;
+				});
+				if (stopping) return;
+				for (shared_ptr<Job>& queued : jobs) {
+					if (!queued->taken) {
+						job = queued;
+						break;
+					}
+				}
+				job->taken = true;
+			}
+			Image image;
+			image.load(job->path.c_str());
+			{
+				lock_guard<mutex> lock(jobsMutex);
+				job->image = move(image);
+				job->decoded = true;
+			}
+			glfwPostEmptyEvent(); // the main loop may be waiting for input
+		}
+	}
+};
+// linked programs are kept on disk so later starts skip compiling, the file name hashes the driver and both sources
+// so an edited shader or a driver update just misses and gets rebuilt
+const char* programCacheDirectory = "shadercache";
+string programCachePath(const string& vertexText, const string& fragmentText) {
+	uint64_t hash = 14695981039346656037ull; // fnv-1a, std::hash may change between builds
+	auto add = [&](const char* text, size_t length) {
+		for (size_t i = 0; i < length; i++) {
+			hash ^= (unsigned char)text[i];
+			hash *= 1099511628211ull;
+		}
+		hash ^= 0xff; // separator, so moving text between the parts changes the hash
+		hash *= 1099511628211ull;
+	};
+	for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+		const char* text = (const char*)glGetString(name);
+		if (text) add(text, strlen(text));
+	}
+	add(vertexText.data(), vertexText.size());
+	add(fragmentText.data(), fragmentText.size());
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+	return string(programCacheDirectory) + "/" + name;
+}
+// false when there's no file or the driver refuses the binary, the program has to be compiled then
+bool loadProgramBinary(unsigned int program, const string& path) {
+	ifstream file(path, ios::binary);
+	if (!file) return false;
+	GLenum format;
+	if (!file.read((char*)&format, sizeof(format))) return false;
+	vector<char> binary((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	if (binary.empty()) return false;
+	glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+	int success;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	return success;
+}
+void saveProgramBinary(unsigned int program, const string& path) {
+	int formats = 0, length = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (formats == 0 || length == 0) return; // the driver can't give binaries back
+	vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(program, length, nullptr, &format, binary.data());
+	error_code error;
+	filesystem::create_directories(programCacheDirectory, error);
+	string temporary = path + ".tmp"; // renamed when complete, another instance never reads half a file
+	ofstream file(temporary, ios::binary);
+	file.write((const char*)&format, sizeof(format));
+	file.write(binary.data(), binary.size());
+	file.close();
+	if (!file) {
+		cout << "[ERROR] failed to write program cache \"" << path << "\"" << endl;
+		filesystem::remove(temporary, error);
+		return;
+	}
+	filesystem::rename(temporary, path, error);
+}
 class Shader {
 public:
 	unsigned int ID;
 
-	Shader(const char* vertexPath, const char* fragmentPath) {
+	// generated replaces the "#pragma generated" line of the fragment shader
+	Shader(const char* vertexPath, const char* fragmentPath, const string& generated = "") {
 		string vertexText;
 		string fragmentText;
 		ifstream vertexFile;
@@ -87,9 +372,17 @@ public:
 			fragmentFile.close();
 			vertexText = vertexStream.str();
 			fragmentText = fragmentStream.str();
+			size_t generatedLine = fragmentText.find("#pragma generated");
+			if (!generated.empty() && generatedLine != string::npos) {
+				fragmentText.replace(generatedLine, fragmentText.find('\n', generatedLine) - generatedLine, generated);
+			}
 		} catch (ifstream::failure const&) {
 			cout << "[ERROR] failed to get fragment or vertex text" << endl;
 		}
+		string cachePath = programCachePath(vertexText, fragmentText);
+		ID = glCreateProgram();
+		if (loadProgramBinary(ID, cachePath)) return;
+		glDeleteProgram(ID); // a refused binary can leave the program in a state that's not worth trusting
 		const char* vertexCode = vertexText.c_str();
 		const char* fragmentCode = fragmentText.c_str();
 
@@ -120,6 +413,7 @@ public:
 		ID = glCreateProgram();
 		glAttachShader(ID, vertex);
 		glAttachShader(ID, fragment);
+		glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 		glLinkProgram(ID);
 
 		//errors
@@ -127,43 +421,144 @@ public:
 		if (!success) {
 			glGetProgramInfoLog(ID, 512, NULL, infoLog);
 			cout << "[ERROR] program failed linking\n" << infoLog << endl;
+		} else {
+			saveProgramBinary(ID, cachePath);
 		}
 
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
 	}
+	Shader(const Shader&) = delete;
+	Shader& operator=(const Shader&) = delete;
+	~Shader() {
+		if (currentProgram == ID) currentProgram = 0;
+		glDeleteProgram(ID);
+	}
 	void use() {
+		if (currentProgram == ID) return;
 		glUseProgram(ID);
+		currentProgram = ID;
 	}
+	static unsigned int currentProgram; // imgui restores whatever program it found, so this stays right
+};
+unsigned int Shader::currentProgram = 0;
+// mirrors the RasterParams uniform block in fragment.fsh, std140 pads the mat3 columns to vec4
+struct RasterBlock {
+	glm::vec4 trans[3];
+	glm::vec4 inverseCoefficients;
+	glm::vec3 col;
+	float a, b, c, d;
+	float aabbl, aabbr, aabbb, aabbt;
+	float ratio;
+	glm::vec2 resolution;
+	float lensTableMaxR, divisionK;
+	glm::ivec2 grid;
+	int aaRes, aaPattern;
+	float aaThreshold;
+	int binarySearchIterations, combineMode, gridNumber, lensModel, lensTableSize;
+	int combineMosaic, showTransform, useLensTable, useWarpMap, warpPass, aaAdaptive; // glsl bools are 4 bytes in std140
+	float percentile;
+	int useVoronoiMap;
+	glm::ivec2 voronoiResolution;
+	int useRectified;
+	int cellStart, cellCount, aaSample;
 };
+static_assert(sizeof(RasterBlock) == 224, "RasterBlock has to match the std140 layout of RasterParams");
+const int rasterBlockBinding = 0;
 class TriangleShader : public Shader {
 public:
-	unsigned int modelLocation, texLocation, colLocation, aLocation, bLocation, cLocation, dLocation, aabblLocation, aabbrLocation, aabbbLocation, aabbtLocation, ratioLocation,
-	aaResLocation, resolutionLocation, transLocation, binarySearchIterationsLocation, combineMosaicLocation, combineModeLocation, showTransformLocation, gridLocation, gridNumberLocation,
-	rasterResolutionLocation;
-	TriangleShader(const char* vertexPath, const char* fragmentPath) : Shader(vertexPath, fragmentPath) {
-		modelLocation = glGetUniformLocation(ID, "modelMat");
+	unsigned int texLocation, rasterResolutionLocation, lensTableLocation, warpMapLocation, warpLayerLocation, voronoiMapLocation, rectifiedLocation;
+	unsigned int cellSumsLocation, sampleSumsLocation;
+	static unsigned int blockBuffer;
+	TriangleShader(const char* vertexPath, const char* fragmentPath, const string& generated = "") : Shader(vertexPath, fragmentPath, generated) {
 		texLocation = glGetUniformLocation(ID, "tex");
-		colLocation = glGetUniformLocation(ID, "col");
-		aLocation = glGetUniformLocation(ID, "a");
-		bLocation = glGetUniformLocation(ID, "b");
-		cLocation = glGetUniformLocation(ID, "c");
-		dLocation = glGetUniformLocation(ID, "d");
-		aabblLocation = glGetUniformLocation(ID, "aabbl");
-		aabbrLocation = glGetUniformLocation(ID, "aabbr");
-		aabbbLocation = glGetUniformLocation(ID, "aabbb");
-		aabbtLocation = glGetUniformLocation(ID, "aabbt");
-		ratioLocation = glGetUniformLocation(ID, "ratio");
-		aaResLocation = glGetUniformLocation(ID, "aaRes");
-		resolutionLocation = glGetUniformLocation(ID, "resolution");
-		transLocation = glGetUniformLocation(ID, "trans");
-		binarySearchIterationsLocation = glGetUniformLocation(ID, "binarySearchIterations");
-		combineMosaicLocation = glGetUniformLocation(ID, "combineMosaic");
-		combineModeLocation = glGetUniformLocation(ID, "combineMode");
-		showTransformLocation = glGetUniformLocation(ID, "showTransform");
-		gridLocation = glGetUniformLocation(ID, "grid");
-		gridNumberLocation = glGetUniformLocation(ID, "gridNumber");
 		rasterResolutionLocation = glGetUniformLocation(ID, "rasterResolution");
+		lensTableLocation = glGetUniformLocation(ID, "lensTable");
+		warpMapLocation = glGetUniformLocation(ID, "warpMap");
+		warpLayerLocation = glGetUniformLocation(ID, "warpLayer");
+		voronoiMapLocation = glGetUniformLocation(ID, "voronoiMap");
+		rectifiedLocation = glGetUniformLocation(ID, "rectified");
+		cellSumsLocation = glGetUniformLocation(ID, "cellSums");
+		sampleSumsLocation = glGetUniformLocation(ID, "sampleSums");
+
+		glUniformBlockBinding(ID, glGetUniformBlockIndex(ID, "RasterParams"), rasterBlockBinding);
+		if (blockBuffer == 0) { // every variant reads the same buffer
+			glGenBuffers(1, &blockBuffer);
+			glBindBuffer(GL_UNIFORM_BUFFER, blockBuffer);
+			glBufferData(GL_UNIFORM_BUFFER, sizeof(RasterBlock), NULL, GL_DYNAMIC_DRAW);
+			glBindBufferBase(GL_UNIFORM_BUFFER, rasterBlockBinding, blockBuffer);
+		}
+	}
+	void setSamplerSlots(int lensTableSlot, int warpMapSlot, int voronoiMapSlot, int rectifiedSlot, int cellSumsSlot, int sampleSumsSlot) {
+		use();
+		glUniform1i(lensTableLocation, lensTableSlot);
+		glUniform1i(warpMapLocation, warpMapSlot);
+		glUniform1i(voronoiMapLocation, voronoiMapSlot);
+		glUniform1i(rectifiedLocation, rectifiedSlot);
+		glUniform1i(cellSumsLocation, cellSumsSlot);
+		glUniform1i(sampleSumsLocation, sampleSumsSlot);
+	}
+	// uploads only when something differs from what the buffer already holds
+	void setBlock(const RasterBlock& block) {
+		if (blockUploaded && memcmp(&block, &uploadedBlock, sizeof(RasterBlock)) == 0) return;
+		glBindBuffer(GL_UNIFORM_BUFFER, blockBuffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(RasterBlock), &block);
+		uploadedBlock = block;
+		blockUploaded = true;
+	}
+	// the per raster uniforms, same deal
+	void setRaster(int slot, int width, int height) {
+		if (slot != rasterSlot) glUniform1i(texLocation, slot);
+		if (width != rasterWidth || height != rasterHeight) glUniform2i(rasterResolutionLocation, width, height);
+		rasterSlot = slot;
+		rasterWidth = width;
+		rasterHeight = height;
+	}
+	void setWarpLayer(int layer) {
+		if (layer != warpLayer) glUniform1i(warpLayerLocation, layer);
+		warpLayer = layer;
+	}
+	// the shared block buffer outlives every variant, so it goes once they're all gone
+	static void releaseBlockBuffer() {
+		if (blockBuffer) glDeleteBuffers(1, &blockBuffer);
+		blockBuffer = 0;
+		blockUploaded = false;
+	}
+private:
+	static RasterBlock uploadedBlock;
+	static bool blockUploaded;
+	int rasterSlot = -1, rasterWidth = -1, rasterHeight = -1, warpLayer = -1;
+};
+unsigned int TriangleShader::blockBuffer = 0;
+RasterBlock TriangleShader::uploadedBlock;
+bool TriangleShader::blockUploaded = false;
+
+const int maxMedianNetworkCells = 48; // the shader's quickselect arrays are this big too, past it the network gets too long to compile quickly
+// medianNetwork() for fragment.fsh, vec3 min/max does all three channels per comparator
+string medianNetworkSource(int cells) {
+	auto comparators = [](const vector<pair<int, int>>& network) {
+		string code;
+		for (auto [i, j] : network) {
+			code += "\tt = min(v[" + to_string(i) + "], v[" + to_string(j) + "]); v[" + to_string(j) + "] = max(v[" + to_string(i) + "], v[" + to_string(j) + "]); v[" + to_string(i) + "] = t;\n";
+		}
+		return code;
+	};
+	vector<int> middle = cells % 2 == 1 ? vector<int>{cells / 2} : vector<int>{cells / 2 - 1, cells / 2};
+	string code = "#define MEDIAN_CELLS " + to_string(cells) + "\n";
+	code += "vec3 medianNetwork(vec3 v[MEDIAN_CELLS], int count) {\n\tvec3 t;\n";
+	code += "\tif (count == MEDIAN_CELLS) {\n" + comparators(selectionNetwork(cells, middle));
+	code += "\t\treturn (v[" + to_string(middle.front()) + "] + v[" + to_string(middle.back()) + "]) * 0.5;\n\t}\n";
+	code += "\tif (count == 0) return vec3(0.);\n";
+	code += comparators(sortingNetwork(cells));
+	code += "\treturn (v[(count - 1) / 2] + v[count / 2]) * 0.5;\n}\n";
+	return code;
+}
+class TileShader : public Shader {
+public:
+	unsigned int texLocation, aabbLocation;
+	TileShader(const char* vertexPath, const char* fragmentPath) : Shader(vertexPath, fragmentPath) {
+		texLocation = glGetUniformLocation(ID, "tex");
+		aabbLocation = glGetUniformLocation(ID, "aabb");
 	}
 };
 class DifferenceShader : public Shader {
@@ -199,19 +594,25 @@ public:
 };
 class ColorShader : public Shader {
 public:
-	unsigned int modelLocation, projLocation, colLocation;
+	unsigned int colLocation;
 	ColorShader(const char* vertexPath, const char* fragmentPath) : Shader(vertexPath, fragmentPath) {
-		modelLocation = glGetUniformLocation(ID, "modelMat");
-		projLocation = glGetUniformLocation(ID, "projMat");
 		colLocation = glGetUniformLocation(ID, "col");
 	}
 };
+class LensLineShader : public Shader {
+public:
+	unsigned int colLocation, viewLocation, resolutionLocation, widthLocation;
+	LensLineShader(const char* vertexPath, const char* fragmentPath) : Shader(vertexPath, fragmentPath) {
+		colLocation = glGetUniformLocation(ID, "col");
+		viewLocation = glGetUniformLocation(ID, "view");
+		resolutionLocation = glGetUniformLocation(ID, "resolution");
+		widthLocation = glGetUniformLocation(ID, "width");
+	}
+};
 class CircleShader : public Shader {
 public:
-	unsigned int modelLocation, projLocation, colLocation;
+	unsigned int colLocation;
 	CircleShader(const char* vertexPath, const char* fragmentPath) : Shader(vertexPath, fragmentPath) {
-		modelLocation = glGetUniformLocation(ID, "modelMat");
-		projLocation = glGetUniformLocation(ID, "projMat");
 		colLocation = glGetUniformLocation(ID, "col");
 	}
 };
@@ -252,6 +653,13 @@ public:
 		if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) cout << "[ERROR] Framebuffer is not complete" << endl;
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
+	FrameBuffer(const FrameBuffer&) = delete;
+	FrameBuffer& operator=(const FrameBuffer&) = delete;
+	~FrameBuffer() {
+		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteTextures(1, &textureColorBuffer);
+		glDeleteRenderbuffers(1, &rbo);
+	}
 
 	void resize(int w, int h) {
 		width = w;
@@ -265,6 +673,46 @@ public:
 		glBindRenderbuffer(GL_RENDERBUFFER, 0);
 	}
 };
+// one rgba8 target per gathered combine mode, filled in one pass by the ALL_MODES shader
+class GatherBuffer {
+public:
+	unsigned int framebuffer;
+	unsigned int textures[gatherModeCount];
+	int width = 0, height = 0;
+	GatherBuffer() {
+		glGenFramebuffers(1, &framebuffer);
+		glGenTextures(gatherModeCount, textures);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		unsigned int attachments[gatherModeCount];
+		for (int i = 0; i < gatherModeCount; i++) {
+			glBindTexture(GL_TEXTURE_2D, textures[i]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			attachments[i] = GL_COLOR_ATTACHMENT0 + i;
+		}
+		glDrawBuffers(gatherModeCount, attachments);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+	~GatherBuffer() {
+		glDeleteTextures(gatherModeCount, textures);
+		glDeleteFramebuffers(1, &framebuffer);
+	}
+	void resize(int w, int h) {
+		if (w == width && h == height) return;
+		width = w;
+		height = h;
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		for (int i = 0; i < gatherModeCount; i++) {
+			glBindTexture(GL_TEXTURE_2D, textures[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, textures[i], 0);
+		}
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) cout << "[ERROR] Gather framebuffer is not complete" << endl;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+};
 int frameWidth = 640, frameHeight = 480;
 void framebuffer_size_callback(GLFWwindow* window, int w, int h) {
 	frameWidth = w;
@@ -348,97 +796,33 @@ public:
 		return square(a.x - b.x) + square(a.y - b.y);
 	}
 };
-struct AABB {
-	float l, r, b, t;
-};
 Point transformPointFromTo(Point p, AABB from, AABB to) {
 	return {lerp(to.l, to.r, invLerp(from.l, from.r, p.x)), lerp(to.b, to.t, invLerp(from.b, from.t, p.y))};
 }
 bool only = false;
+// what a rectified raster depends on, the view isn't part of it so panning and zooming reuse the pass
+struct RectifyKey {
+	WarpKey warp; // at the unit aabb and the rectified size
+	bool nearest;
+	unsigned int texture;
+	int level;
+	bool operator==(const RectifyKey& o) const {
+		return warp == o.warp && nearest == o.nearest && texture == o.texture && level == o.level;
+	}
+};
 struct Raster {
 	shared_ptr<Texture> texture;
+	shared_ptr<FrameBuffer> rectified; // the rectify pass output, kept while rectifiedKey matches
+	RectifyKey rectifiedKey;
 	Raster(shared_ptr<Texture> tex) {
 		texture = tex;
 	}
 };
 bool save = false;
-
-glm::mat3 adj(glm::mat3 m) { // no problem
-	return glm::mat3(
-		m[1][1]*m[2][2]-m[2][1]*m[1][2], m[2][0]*m[1][2]-m[1][0]*m[2][2], m[1][0]*m[2][1]-m[2][0]*m[1][1],
-		m[2][1]*m[0][2]-m[0][1]*m[2][2], m[0][0]*m[2][2]-m[2][0]*m[0][2], m[2][0]*m[0][1]-m[0][0]*m[2][1],
-		m[0][1]*m[1][2]-m[1][1]*m[0][2], m[1][0]*m[0][2]-m[0][0]*m[1][2], m[0][0]*m[1][1]-m[1][0]*m[0][1]
-	);
-}
-glm::mat3 adj321(glm::mat3 m) { // no problem
-	return glm::mat3(
-		m[1][1]*m[2][2]-m[1][2]*m[2][1], m[0][2]*m[2][1]-m[0][1]*m[2][2], m[0][1]*m[1][2]-m[0][2]*m[1][1],
-		m[1][2]*m[2][0]-m[1][0]*m[2][2], m[0][0]*m[2][2]-m[0][2]*m[2][0], m[0][2]*m[1][0]-m[0][0]*m[1][2],
-		m[1][0]*m[2][1]-m[1][1]*m[2][0], m[0][1]*m[2][0]-m[0][0]*m[2][1], m[0][0]*m[1][1]-m[0][1]*m[1][0]
-	);
-}
-glm::mat3 multmm(glm::mat3 a, glm::mat3 b) { // multiply two matrices
-  glm::mat3 c;
-  for (int i = 0; i != 3; ++i) {
-    for (int j = 0; j != 3; ++j) {
-      float cij = 0.f;
-      for (int k = 0; k != 3; ++k) {
-        cij += a[i][k]*b[k][j];
-      }
-      c[i][j] = cij;
-    }
-  }
-  return c;
-}
-glm::mat3 basisToPoints(float x1, float y1, float x2, float y2, float x3, float y3, float x4, float y4) { // no problem
-	glm::mat3 m = glm::mat3(
-		x1, x2, x3,
-		y1, y2, y3,
-		1.f,  1.f,  1.f
-	);
-	glm::vec3 v = adj(m) * glm::vec3(x4, y4, 1.);
-	//cout << v.x << ", " << v.y << ", " << v.z << endl;
-	glm::mat3 asd = multmm(m, glm::mat3(
-		v.x, 0.f, 0.f,
-		0.f, v.y, 0.f,
-		0.f, 0.f, v.z
-	));
-	//cout << asd[0][0] << ", " << asd[0][1] << ", " << asd[0][2] << ", " << asd[1][0] << ", " << asd[1][1] << ", " << asd[1][2] << ", " << asd[2][0] << ", " << asd[2][1] << ", " << asd[2][2] << endl;
-	return asd;
-}
-glm::mat3 general2DProjection( // no problem
-	float x1s, float y1s, float x1d, float y1d,
-	float x2s, float y2s, float x2d, float y2d,
-	float x3s, float y3s, float x3d, float y3d,
-	float x4s, float y4s, float x4d, float y4d
-) {
-	glm::mat3 s = basisToPoints(x1s, y1s, x2s, y2s, x3s, y3s, x4s, y4s); // good
-	glm::mat3 d = basisToPoints(x1d, y1d, x2d, y2d, x3d, y3d, x4d, y4d); // good
-	glm::mat3 asd = multmm(d, adj321(s));
-	return asd;
-
-}
-glm::mat3 transform2d(float x1, float y1, float x2, float y2, float x3, float y3, float x4, float y4) {
-	float w = 1.f;
-	float h = 1.f;
-	glm::mat3 t = general2DProjection(
-		0.f, 0.f, x1, y1,
-		w , 0.f, x4, y4,
-		0.f, h , x2, y2,
-		w , h , x3, y3
-	);
-	for (int x = 0; x < 3; x++) {
-		for (int y = 0; y < 3; y++) {
-			t[x][y] /= t[2][2];
-		}
-	}
-	t = glm::mat3(
-		t[0][0], t[1][0], t[2][0],
-		t[0][1], t[1][1], t[2][1],
-		t[0][2], t[1][2], t[2][2]
-	);
-	return t;
-}
+int saveAaRes = 3; // samples per side when saving, the view stays at 1
+int aaPattern = AA_ORDERED;
+bool aaAdaptive = true;
+float aaThreshold = 1.f / 32.f;
 
 Point transformQuad[4] = {{0.f, 0.f}, {0.f, 1.f}, {1.f, 1.f}, {1.f, 0.f}};
 int gridX = 3;
@@ -446,37 +830,143 @@ int gridY = 3;
 
 vector<Raster> rasters;
 float a = 0.f, b = 0.f, c = 0.f, d = 1.f;
-float ratio = 1.5f;
+float aspectRatio = 1.5f;
 int binarySearchIterations = 10;
 glm::mat3 trans = glm::mat3(1.f);
+glm::mat3 inverseTrans = glm::mat3(1.f); // follows trans, inverseTransformPoint runs for every overlay endpoint
 
 int tris = 0;
 bool ddo = true;
 bool combineMosaic = false;
 int combineMode = 0;
+float percentile = 0.5f;
+bool compareModes = false; // every gathered mode side by side instead of just combineMode
 bool showTransform = false;
 int gridNumber = 0;
+bool useLensTable = true;
+LensModel lensModel;
+LensTable lensTable;
+unsigned int lensTableTexture = 0;
+const int lensTableSlot = 8; // after the raster textures
+const int warpMapSlot = 9;
+const int mosaicTileSlot = 10;
+const int voronoiMapSlot = 11;
+const int rectifiedSlot = 12;
+const int cellSumsSlot = 13;
+const int sampleSumsSlot = 14;
+bool nearest = true;
+
+class WarpMapTexture {
+public:
+	unsigned int id;
+	int width, height, layers;
+	unsigned int voronoiMap = 0; // winning voronoi uv per pixel, made the first time voronoi is picked with this warp
+	glm::ivec2 voronoiResolution = glm::ivec2(0); // the raster size it was picked for
+	WarpMapTexture(int w, int h, int l) : width(w), height(h), layers(l) {
+		glGenTextures(1, &id);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RG32F, w, h, l, 0, GL_RG, GL_FLOAT, NULL);
+	}
+	~WarpMapTexture() {
+		glDeleteTextures(1, &id);
+		if (voronoiMap) glDeleteTextures(1, &voronoiMap);
+	}
+};
+BudgetCache<WarpKey, WarpMapTexture> warpMapCache((size_t)256 << 20);
+bool useWarpMapCache = true;
+bool accumulateCells = true; // big mean grids go through CellAccumulation instead of one long draw
+const int accumulateMinCells = 64; // cells times aa samples per pixel, below this one draw is quick anyway
+bool rectifyMosaic = false; // warp each raster once into its rectified buffer, the cells are fetched from there
+float rectifyDensity = 1.f; // rectified texels per source pixel of the quad
+unsigned int warpFramebuffer = 0;
 float asdasd1 = 0.38f;
 float asdasd2 = 0.5f;
 
-float lensDistortion(float r, float a, float b, float c, float d) {
-	return (a * glm::pow(r, 3.f) + b * glm::pow(r, 2.f) + c * r + d) * r;
+bool lensTableActive() {
+	return useLensTable && lensTable.valid && lensModel.type == LENS_POLYNOMIAL;
 }
-float inverseLensDistortion(float distortedR, float a, float b, float c, float d) {
-    float r = distortedR;
-
-    for (int i = 0; i < binarySearchIterations; i++) { // 10 iterations should be sufficient
-        float f = lensDistortion(r, a, b, c, d) - distortedR;
-        float derivative = r * r * (4.f * a * r + 3.f * b) + 2.f * c * r + d;
-
-        if (abs(derivative) < 1e-6) {
-            break;
-        }
-
-        r -= f / derivative;
-    }
-
-    return r;
+// keeps the inverse polynomial fitted to the a,b,c,d sliders
+void updateLensModel() {
+	static glm::vec4 fittedCoefficients = glm::vec4(NAN);
+	static int fittedIterations = -1;
+	static float fittedRatio = NAN;
+	if (lensModel.type != LENS_INVERSE_POLYNOMIAL) return;
+	if (fittedCoefficients == glm::vec4(a, b, c, d) && fittedIterations == binarySearchIterations && fittedRatio == aspectRatio) return;
+	lensModel = fitLensModel(LENS_INVERSE_POLYNOMIAL, a, b, c, d, binarySearchIterations, lensTableRange(aspectRatio));
+	fittedCoefficients = glm::vec4(a, b, c, d);
+	fittedIterations = binarySearchIterations;
+	fittedRatio = aspectRatio;
+}
+// rebuilds the table only when the sliders moved, then uploads it as a r32f texture rowWidth wide
+void updateLensTable() {
+	if (!useLensTable || lensModel.type != LENS_POLYNOMIAL || lensTable.matches(a, b, c, d, binarySearchIterations, lensTableRange(aspectRatio))) return;
+	lensTable.build(a, b, c, d, binarySearchIterations, lensTableRange(aspectRatio));
+	if (!lensTable.valid) return;
+
+	if (lensTableTexture == 0) glGenTextures(1, &lensTableTexture);
+	glActiveTexture(GL_TEXTURE0 + lensTableSlot);
+	glBindTexture(GL_TEXTURE_2D, lensTableTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	int rows = (int)lensTable.values.size() / LensTable::rowWidth;
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, LensTable::rowWidth, rows, 0, GL_RED, GL_FLOAT, lensTable.values.data());
+	glActiveTexture(GL_TEXTURE0);
+}
+RenderParams currentParams(AABB viewAabb) {
+	RenderParams p;
+	p.a = a;
+	p.b = b;
+	p.c = c;
+	p.d = d;
+	p.ratio = aspectRatio;
+	p.binarySearchIterations = binarySearchIterations;
+	p.trans = trans;
+	p.showTransform = showTransform;
+	p.combineMosaic = combineMosaic;
+	p.combineMode = combineMode;
+	p.percentile = percentile;
+	p.gridX = gridX;
+	p.gridY = gridY;
+	p.gridNumber = gridNumber;
+	p.aabb = viewAabb;
+	p.nearest = nearest;
+	p.lens = lensModel;
+	p.lensTable = lensTableActive() ? &lensTable : nullptr;
+	return p;
+}
+Recipe currentRecipe(AABB viewAabb) {
+	Recipe recipe;
+	recipe.params = currentParams(viewAabb);
+	recipe.useLensTable = useLensTable;
+	recipe.params.aaRes = saveAaRes; // the batch output should look like Save
+	recipe.params.aaPattern = aaPattern;
+	recipe.params.aaAdaptive = aaAdaptive;
+	recipe.params.aaThreshold = aaThreshold;
+	for (int i = 0; i < 4; i++) recipe.transformQuad[i] = glm::vec2(transformQuad[i].x, transformQuad[i].y);
+	recipe.width = frameWidth;
+	recipe.height = frameHeight;
+	return recipe;
+}
+// everything the raster pass output depends on, the cached frame in renderBuffer is reused while this stays the same
+struct RasterKey {
+	WarpKey warp;
+	int combineMode, gridNumber;
+	float percentile;
+	bool nearest, mosaicTileOnce, compareModes, rectifyMosaic, accumulateCells;
+	float rectifyDensity;
+	unsigned int texture;
+	bool operator==(const RasterKey& o) const {
+		return warp == o.warp && combineMode == o.combineMode && gridNumber == o.gridNumber && percentile == o.percentile && nearest == o.nearest &&
+			mosaicTileOnce == o.mosaicTileOnce && compareModes == o.compareModes && rectifyMosaic == o.rectifyMosaic && rectifyDensity == o.rectifyDensity &&
+			accumulateCells == o.accumulateCells && texture == o.texture;
+	}
+};
+RasterKey rasterKey(AABB viewAabb, int width, int height, bool mosaicTileOnce, unsigned int texture) {
+	return {warpKey(currentParams(viewAabb), width, height), combineMode, gridNumber, percentile, nearest, mosaicTileOnce, compareModes, rectifyMosaic, accumulateCells, rectifyDensity, texture};
 }
 glm::vec2 transformPoint(glm::vec2 uv, bool lens) {
 	if (showTransform) {
@@ -487,69 +977,499 @@ glm::vec2 transformPoint(glm::vec2 uv, bool lens) {
 
 	if (!lens) return uv;
 	uv = uv * 2.f - 1.f;
-	uv.x *= ratio;
+	uv.x *= aspectRatio;
 	float r = glm::length(uv);
-	r = inverseLensDistortion(r, a, b, c, d);
+	r = lensInverse(r, currentParams({0.f, 1.f, 0.f, 1.f}));
 	uv = glm::normalize(uv) * r;
-	uv.x /= ratio;
+	uv.x /= aspectRatio;
 	return (uv + 1.f) * 0.5f;
 }
 glm::vec2 inverseTransformPoint(glm::vec2 uv) {
 	uv = uv * 2.f - 1.f;
-	uv.x *= ratio;
+	uv.x *= aspectRatio;
 	float r = glm::length(uv);
-	r = lensDistortion(r, a, b, c, d);
+	r = lensForward(r, currentParams({0.f, 1.f, 0.f, 1.f}));
 	uv = glm::normalize(uv) * r;
-	uv.x /= ratio;
+	uv.x /= aspectRatio;
 	uv = (uv + 1.f) * 0.5f;
 
 	if (showTransform) {
 		glm::vec3 transformed = glm::vec3(uv, 1.f);
-		transformed = glm::inverse(trans) * transformed;
+		transformed = inverseTrans * transformed;
 		uv = glm::vec2(transformed.x, transformed.y) / transformed.z;
 	}
 
 
 	return uv;
 }
-void renderRasters(TriangleShader* triangleShader, AABB aabb, int aaRes, int width, int height, int howManyRasterTextures, int endI) {
+map<string, unique_ptr<TriangleShader>> rasterShaders; // by their generated code, built the first time those settings are used and then kept
+// the program the raster passes should use: fragment.fsh with the mosaic, combine mode, transform and aa settings as constants,
+// plus the median network for the current grid, so switching back to a mode never compiles again
+TriangleShader* rasterShader(int aaRes) {
+	int cells = gridX * gridY;
+	bool adaptive = aaAdaptive && aaRes > 2; // the shader only looks at it past 2x2
+	string generated = "#define SPECIALIZED\n";
+	generated += string("#define SPECIALIZED_MOSAIC ") + (combineMosaic ? "true" : "false") + "\n";
+	generated += "#define SPECIALIZED_MODE " + to_string(combineMosaic ? combineMode : 0) + "\n";
+	generated += string("#define SPECIALIZED_TRANSFORM ") + (showTransform ? "true" : "false") + "\n";
+	generated += "#define SPECIALIZED_AA_RES " + to_string(aaRes) + "\n";
+	generated += string("#define SPECIALIZED_AA_ADAPTIVE ") + (adaptive ? "true" : "false") + "\n";
+	if (combineMosaic && combineMode == 1 && cells <= maxMedianNetworkCells) generated += medianNetworkSource(cells);
+	unique_ptr<TriangleShader>& shader = rasterShaders[generated];
+	if (!shader) {
+		shader = make_unique<TriangleShader>("shaders/raster.vsh", "shaders/fragment.fsh", generated);
+		shader->setSamplerSlots(lensTableSlot, warpMapSlot, voronoiMapSlot, rectifiedSlot, cellSumsSlot, sampleSumsSlot);
+	}
+	return shader.get();
+}
+unique_ptr<TriangleShader> gatherShader; // the ALL_MODES variant, built the first time modes are compared
+TriangleShader* gatherModesShader() {
+	if (!gatherShader) {
+		gatherShader = make_unique<TriangleShader>("shaders/raster.vsh", "shaders/fragment.fsh", "#define ALL_MODES\n");
+		gatherShader->setSamplerSlots(lensTableSlot, warpMapSlot, voronoiMapSlot, rectifiedSlot, cellSumsSlot, sampleSumsSlot);
+	}
+	return gatherShader.get();
+}
+RasterBlock rasterBlock(AABB aabb, int aaRes, int width, int height, bool useWarpMap, bool warpPass) {
+	RasterBlock block = {};
+	for (int i = 0; i < 3; i++) block.trans[i] = glm::vec4(trans[i], 0.f);
+	block.inverseCoefficients = lensModel.inverse;
+	block.col = glm::vec3(1.f);
+	block.a = a;
+	block.b = b;
+	block.c = c;
+	block.d = d;
+	block.aabbl = aabb.l;
+	block.aabbr = aabb.r;
+	block.aabbb = aabb.b;
+	block.aabbt = aabb.t;
+	block.ratio = aspectRatio;
+	block.resolution = glm::vec2((float)width, (float)height);
+	block.lensTableMaxR = lensTable.maxR;
+	block.divisionK = lensModel.k;
+	block.grid = glm::ivec2(gridX, gridY);
+	block.aaRes = aaRes;
+	block.aaPattern = aaPattern;
+	block.aaThreshold = aaThreshold;
+	block.binarySearchIterations = binarySearchIterations;
+	block.combineMode = combineMode;
+	block.gridNumber = gridNumber;
+	block.lensModel = lensModel.type;
+	block.lensTableSize = (int)lensTable.values.size();
+	block.combineMosaic = combineMosaic;
+	block.showTransform = showTransform;
+	block.useLensTable = lensTableActive();
+	block.useWarpMap = useWarpMap;
+	block.warpPass = warpPass;
+	block.aaAdaptive = aaAdaptive;
+	block.percentile = percentile;
+	return block;
+}
+// about one tile texel per source pixel, the rectified quad (or the whole image without the transform) split by the grid
+glm::ivec2 mosaicTileSize(int rasterWidth, int rasterHeight) {
+	float w = (float)rasterWidth, h = (float)rasterHeight;
+	if (showTransform) {
+		glm::vec2 size = glm::vec2((float)rasterWidth, (float)rasterHeight);
+		glm::vec2 q[4];
+		for (int i = 0; i < 4; i++) q[i] = glm::vec2(transformQuad[i].x, transformQuad[i].y) * size;
+		w = max(glm::distance(q[0], q[3]), glm::distance(q[1], q[2]));
+		h = max(glm::distance(q[0], q[1]), glm::distance(q[3], q[2]));
+	}
+	return glm::clamp(glm::ivec2((int)ceil(w / (float)gridX), (int)ceil(h / (float)gridY)), 1, 4096);
+}
+// the mip level with about one texel per output pixel over aabb, so zoomed out views sample a prefiltered level
+int previewLevel(const Texture& texture, AABB aabb, int width, int height) {
+	glm::vec2 texels = glm::vec2(mosaicTileSize(texture.width, texture.height)); // across one grid cell, the view's uv unit with the mosaic
+	if (!combineMosaic) texels *= glm::vec2((float)gridX, (float)gridY);
+	float footprint = min(texels.x * (aabb.r - aabb.l) / (float)width, texels.y * (aabb.t - aabb.b) / (float)height);
+	if (footprint < 2.f) return 0;
+	return min((int)floor(log2(footprint)), texture.levels - 1);
+}
+bool rectifyActive() {
+	return rectifyMosaic && combineMosaic && combineMode != 5 && !rasters.empty(); // voronoi needs the source uvs, not colors
+}
+// the whole quad at rectifyDensity texels per sampled source pixel, capped at what a texture can hold
+glm::ivec2 rectifiedSize() {
+	int maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	glm::ivec2 source = rasters[0].texture->sampledSize();
+	glm::vec2 size = glm::vec2(mosaicTileSize(source.x, source.y) * glm::ivec2(gridX, gridY)) * rectifyDensity;
+	return glm::clamp(glm::ivec2(glm::ceil(size)), 1, maxSize);
+}
+unique_ptr<TriangleShader> rectifyShader; // the RECTIFY_PASS variant, none of the combine code so it stays cheap per texel
+// first pass of the rectified path: one warp per texel of the raster's rectified buffer instead of one per cell per pixel
+// the buffer is bound to rectifiedSlot either way, the pass only runs when its key changed
+void rectifyRaster(RasterBlock block, Raster& raster) {
+	glm::ivec2 size = rectifiedSize();
+	RectifyKey key = {warpKey(currentParams({0.f, 1.f, 0.f, 1.f}), size.x, size.y), nearest, raster.texture->id, raster.texture->level};
+	bool current = raster.rectified && key == raster.rectifiedKey;
+	glActiveTexture(GL_TEXTURE0 + rectifiedSlot);
+	if (!raster.rectified) {
+		raster.rectified = make_shared<FrameBuffer>(size.x, size.y);
+	} else if (raster.rectified->width != size.x || raster.rectified->height != size.y) {
+		raster.rectified->resize(size.x, size.y);
+	}
+	// cells often land right on texel centers where linear can round onto a neighbour, so nearest rasters stay nearest
+	glBindTexture(GL_TEXTURE_2D, raster.rectified->textureColorBuffer);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, nearest ? GL_NEAREST : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, nearest ? GL_NEAREST : GL_LINEAR);
+	glActiveTexture(GL_TEXTURE0);
+	if (current) return;
+	raster.rectifiedKey = key;
+
+	if (!rectifyShader) {
+		rectifyShader = make_unique<TriangleShader>("shaders/raster.vsh", "shaders/fragment.fsh", "#define RECTIFY_PASS\n");
+		rectifyShader->setSamplerSlots(lensTableSlot, warpMapSlot, voronoiMapSlot, rectifiedSlot, cellSumsSlot, sampleSumsSlot);
+	}
+
+	GLint target = 0, viewport[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glBindFramebuffer(GL_FRAMEBUFFER, raster.rectified->framebuffer);
+	glViewport(0, 0, size.x, size.y);
+	glDisable(GL_BLEND);
+	block.useRectified = false;
+	rectifyShader->use();
+	rectifyShader->setBlock(block);
+	rectifyShader->setRaster(raster.texture->slot, raster.texture->sampledSize().x, raster.texture->sampledSize().y);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+	glEnable(GL_BLEND);
+	glBindFramebuffer(GL_FRAMEBUFFER, target);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	tris += 2;
+}
+// rectify says whether the cells come from the rectified buffers, the mode comparison never reads them
+void renderRasters(TriangleShader* triangleShader, AABB aabb, int aaRes, int width, int height, int howManyRasterTextures, int endI, WarpMapTexture* warpMap, bool rectify) {
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	triangleShader->use();
+	if (warpMap) {
+		glActiveTexture(GL_TEXTURE0 + warpMapSlot);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, warpMap->id);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	// one block for every raster, only the texture changes in the loop
+	RasterBlock block = rasterBlock(aabb, aaRes, width, height, warpMap != nullptr, false);
+	if (warpMap && warpMap->voronoiMap && combineMode == 5) {
+		glActiveTexture(GL_TEXTURE0 + voronoiMapSlot);
+		glBindTexture(GL_TEXTURE_2D, warpMap->voronoiMap);
+		glActiveTexture(GL_TEXTURE0);
+		block.useVoronoiMap = true;
+		block.voronoiResolution = warpMap->voronoiResolution;
+	}
+	block.useRectified = rectify;
+	if (!rectify) triangleShader->setBlock(block);
 
 	int i = 0;
 	for (Raster& raster : rasters) {
 		if (i > endI && endI != -1) break;
 		i++;
 		//if (!aabbIntersect(raster.aabb, aabb)) continue;
-		glm::mat4 model = glm::mat4(1.f);
-		glUniformMatrix4fv(triangleShader->modelLocation, 1, GL_FALSE, glm::value_ptr(model));
-		glUniform3f(triangleShader->colLocation, 1.f, 1.f, 1.f);
-		glUniform1i(triangleShader->texLocation, raster.texture->slot);
-		glUniform1f(triangleShader->aLocation, a);
-		glUniform1f(triangleShader->bLocation, b);
-		glUniform1f(triangleShader->cLocation, c);
-		glUniform1f(triangleShader->dLocation, d);
-		glUniform1f(triangleShader->aabblLocation, aabb.l);
-		glUniform1f(triangleShader->aabbrLocation, aabb.r);
-		glUniform1f(triangleShader->aabbbLocation, aabb.b);
-		glUniform1f(triangleShader->aabbtLocation, aabb.t);
-		glUniform1f(triangleShader->ratioLocation, ratio);
-		glUniform1i(triangleShader->aaResLocation, aaRes);
-		glUniform2f(triangleShader->resolutionLocation, (float)width, (float)height);
-		glUniform1i(triangleShader->binarySearchIterationsLocation, binarySearchIterations);
-		if (ddo) trans = transform2d(transformQuad[0].x, transformQuad[0].y, transformQuad[1].x, transformQuad[1].y, transformQuad[2].x, transformQuad[2].y, transformQuad[3].x, transformQuad[3].y);
-		glUniformMatrix3fv(triangleShader->transLocation, 1, GL_FALSE, glm::value_ptr(trans));
-		glUniform1i(triangleShader->combineMosaicLocation, combineMosaic);
-		glUniform1i(triangleShader->combineModeLocation, combineMode);
-		glUniform1i(triangleShader->showTransformLocation, showTransform);
-		glUniform2i(triangleShader->gridLocation, gridX, gridY);
-		glUniform1i(triangleShader->gridNumberLocation, gridNumber);
-		glUniform2i(triangleShader->rasterResolutionLocation, raster.texture->width, raster.texture->height);
+		if (rectify) { // every raster warps differently, so each gets its own rectify pass right before it's reduced
+			rectifyRaster(block, raster);
+			triangleShader->use();
+			triangleShader->setBlock(block);
+		}
+		triangleShader->setRaster(raster.texture->slot, raster.texture->sampledSize().x, raster.texture->sampledSize().y);
 		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 		tris += 2;
 	}
 }
+bool accumulationActive(int aaRes) {
+	return accumulateCells && combineMosaic && combineMode == 0 && !compareModes && !rasters.empty() && gridX * gridY * aaRes * aaRes >= accumulateMinCells;
+}
+// the mean of big grids summed a batch of cells per draw into float targets and resolved at the end, so no single
+// draw loops over hundreds of cells times the aa pattern and the editor keeps drawing frames while it runs
+class CellAccumulation {
+public:
+	bool active = false;
+	int batchCells = 8; // adapts so one batch takes about batchMs
+	const double batchMs = 8.;
+
+	~CellAccumulation() {
+		if (!framebuffers[0]) return;
+		glDeleteFramebuffers(2, framebuffers);
+		glDeleteTextures(2, textures);
+	}
+	void start(AABB aabb, int aaRes, int width, int height, shared_ptr<WarpMapTexture> warpMap) {
+		if (!accumulateShader) {
+			accumulateShader = make_unique<TriangleShader>("shaders/raster.vsh", "shaders/fragment.fsh", "#define ACCUMULATE_CELLS\n");
+			resolveShader = make_unique<TriangleShader>("shaders/raster.vsh", "shaders/fragment.fsh", "#define RESOLVE_CELLS\n");
+			accumulateShader->setSamplerSlots(lensTableSlot, warpMapSlot, voronoiMapSlot, rectifiedSlot, cellSumsSlot, sampleSumsSlot);
+			resolveShader->setSamplerSlots(lensTableSlot, warpMapSlot, voronoiMapSlot, rectifiedSlot, cellSumsSlot, sampleSumsSlot);
+			glGenFramebuffers(2, framebuffers);
+			glGenTextures(2, textures);
+		}
+		if (width != this->width || height != this->height) {
+			for (int i = 0; i < 2; i++) {
+				glBindTexture(GL_TEXTURE_2D, textures[i]);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+				glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[i], 0);
+				if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) cout << "[ERROR] Accumulation framebuffer is not complete" << endl;
+			}
+			this->width = width;
+			this->height = height;
+		}
+		clear(0);
+		clear(1);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		this->aabb = aabb;
+		this->aaRes = aaRes;
+		this->warpMap = aaRes == 1 ? warpMap : nullptr; // the map only has pixel centers
+		cells = gridX * gridY;
+		rasterCount = (int)rasters.size();
+		raster = sample = nextCell = 0;
+		active = true;
+	}
+	float progress() const {
+		int samples = aaRes * aaRes;
+		return (float)(((double)raster * samples + sample) * cells + nextCell) / (float)((double)rasterCount * samples * cells);
+	}
+	// batches until budgetMs is used up, each finished raster is blended into target, true once all of them are
+	bool step(double budgetMs, unsigned int target) {
+		auto start = chrono::steady_clock::now();
+		glBlendFunc(GL_ONE, GL_ONE);
+		glViewport(0, 0, width, height);
+		while (active) {
+			if (raster >= (int)rasters.size()) { // rasters were removed under it
+				active = false;
+				break;
+			}
+			auto batchStart = chrono::steady_clock::now();
+			glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[0]);
+			bindSums(false, false);
+			draw(accumulateShader.get(), sample, nextCell, batchCells);
+			glFinish(); // otherwise the batches only queue up and the timing means nothing
+			double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - batchStart).count();
+			nextCell += batchCells;
+			if (ms < batchMs * 0.5) batchCells = min(batchCells * 2, cells);
+			else if (ms > batchMs * 2.) batchCells = max(batchCells / 2, 1);
+
+			if (nextCell >= cells) { // this aa sample is done, add its mean to the others
+				glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[1]);
+				bindSums(true, false);
+				draw(resolveShader.get(), sample, 0, 0);
+				clear(0);
+				nextCell = 0;
+				sample++;
+			}
+			if (sample == aaRes * aaRes) { // raster done, onto the target like renderRasters would
+				glBindFramebuffer(GL_FRAMEBUFFER, target);
+				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+				bindSums(true, true);
+				draw(resolveShader.get(), -1, 0, 0);
+				glBlendFunc(GL_ONE, GL_ONE);
+				clear(1);
+				sample = 0;
+				raster++;
+				if (raster == rasterCount) active = false;
+			}
+			if (chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() > budgetMs) break;
+		}
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, frameWidth, frameHeight);
+		return !active;
+	}
+	// the raster still running as it looks so far, over whatever is bound
+	void preview() {
+		if (!active) return;
+		bindSums(true, true);
+		draw(resolveShader.get(), -1, 0, 0);
+	}
+private:
+	unique_ptr<TriangleShader> accumulateShader, resolveShader;
+	unsigned int framebuffers[2] = {0, 0}, textures[2] = {0, 0}; // cell sums of the running aa sample, sum of the finished sample means
+	int width = 0, height = 0;
+	AABB aabb;
+	int aaRes = 1, cells = 0, rasterCount = 0;
+	int raster = 0, sample = 0, nextCell = 0; // where the next batch starts
+	shared_ptr<WarpMapTexture> warpMap;
+
+	void clear(int i) {
+		const float zero[4] = {0.f, 0.f, 0.f, 0.f};
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+		glClearBufferfv(GL_COLOR, 0, zero);
+	}
+	// a texture can't be read while it's being drawn into, so only the ones the next draw reads are bound
+	void bindSums(bool cellSums, bool sampleSums) {
+		glActiveTexture(GL_TEXTURE0 + cellSumsSlot);
+		glBindTexture(GL_TEXTURE_2D, cellSums ? textures[0] : 0);
+		glActiveTexture(GL_TEXTURE0 + sampleSumsSlot);
+		glBindTexture(GL_TEXTURE_2D, sampleSums ? textures[1] : 0);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	void draw(TriangleShader* shader, int aaSample, int cellStart, int cellCount) {
+		shader->use();
+		if (warpMap) {
+			glActiveTexture(GL_TEXTURE0 + warpMapSlot);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, warpMap->id);
+			glActiveTexture(GL_TEXTURE0);
+		}
+		RasterBlock block = rasterBlock(aabb, aaRes, width, height, warpMap != nullptr, false);
+		block.aaSample = aaSample;
+		block.cellStart = cellStart;
+		block.cellCount = cellCount;
+		shader->setBlock(block);
+		Raster& current = rasters[raster];
+		shader->setRaster(current.texture->slot, current.texture->sampledSize().x, current.texture->sampledSize().y);
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+		tris += 2;
+	}
+};
+// voronoi picks one cell per pixel from the warp map, that pick only changes with the warp or the raster size,
+// so it's stored next to the map and a filter change is just one fetch per pixel
+void updateVoronoiMap(TriangleShader* triangleShader, WarpMapTexture& warpMap, const WarpKey& key, AABB aabb) {
+	glm::ivec2 resolution = rasters[0].texture->sampledSize();
+	if (!combineMosaic || combineMode != 5 || warpMap.voronoiResolution == resolution) return;
+
+	if (!warpMap.voronoiMap) {
+		glGenTextures(1, &warpMap.voronoiMap);
+		glBindTexture(GL_TEXTURE_2D, warpMap.voronoiMap);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, warpMap.width, warpMap.height, 0, GL_RG, GL_FLOAT, NULL);
+		warpMapCache.grow(key, (size_t)warpMap.width * (size_t)warpMap.height * sizeof(glm::vec2));
+	}
+	warpMap.voronoiResolution = resolution;
+
+	if (warpFramebuffer == 0) glGenFramebuffers(1, &warpFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, warpFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, warpMap.voronoiMap, 0);
+	glViewport(0, 0, warpMap.width, warpMap.height);
+	glDisable(GL_BLEND);
+	glActiveTexture(GL_TEXTURE0 + warpMapSlot);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, warpMap.id);
+	glActiveTexture(GL_TEXTURE0);
+	triangleShader->use();
+	triangleShader->setBlock(rasterBlock(aabb, 1, warpMap.width, warpMap.height, true, true));
+	triangleShader->setRaster(rasters[0].texture->slot, resolution.x, resolution.y);
+	triangleShader->setWarpLayer(warpMap.layers); // one past the last cell means the voronoi pick
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+	glEnable(GL_BLEND);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, frameWidth, frameHeight);
+}
+// warped uvs of the current view, one warp pass per grid cell only when something in the WarpKey changed
+// null when the map wouldn't fit the budget, the shader warps per pixel then
+WarpKey lastWarpMiss; // the key of the last map that wasn't cached
+bool anyWarpMiss = false;
+// nullptr means render directly: building costs a pass per cell, so a map is only built for a key that missed twice in a row
+// while the view or the warp is being dragged every frame has a new key and nothing gets built or evicted
+shared_ptr<WarpMapTexture> getWarpMap(TriangleShader* triangleShader, AABB aabb, int width, int height) {
+	WarpKey key = warpKey(currentParams(aabb), width, height);
+	shared_ptr<WarpMapTexture> warpMap = warpMapCache.find(key);
+	if (rasters.empty()) return warpMap;
+	if (warpMap) {
+		updateVoronoiMap(triangleShader, *warpMap, key, aabb);
+		return warpMap;
+	}
+	bool settled = anyWarpMiss && key == lastWarpMiss;
+	lastWarpMiss = key;
+	anyWarpMiss = true;
+	if (!settled) return nullptr;
+
+	int layers = key.gridX * key.gridY;
+	int maxLayers = 0;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+	size_t bytes = (size_t)width * (size_t)height * (size_t)layers * sizeof(glm::vec2);
+	if (layers > maxLayers || bytes > warpMapCache.budget) return nullptr;
+
+	warpMap = make_shared<WarpMapTexture>(width, height, layers);
+	if (warpFramebuffer == 0) glGenFramebuffers(1, &warpFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, warpFramebuffer);
+	glViewport(0, 0, width, height);
+	glDisable(GL_BLEND);
+	triangleShader->use();
+	triangleShader->setBlock(rasterBlock(aabb, 1, width, height, false, true));
+	triangleShader->setRaster(rasters[0].texture->slot, rasters[0].texture->sampledSize().x, rasters[0].texture->sampledSize().y);
+	for (int i = 0; i < layers; i++) {
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, warpMap->id, 0, i);
+		triangleShader->setWarpLayer(i);
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+	}
+	glEnable(GL_BLEND);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, frameWidth, frameHeight);
+
+	warpMapCache.insert(key, warpMap, bytes);
+	updateVoronoiMap(triangleShader, *warpMap, key, aabb);
+	return warpMap;
+}
+// makes the tile framebuffer fit the current raster, returns its size
+glm::ivec2 allocateMosaicTile(unique_ptr<FrameBuffer>& mosaicTile) {
+	glm::ivec2 size = mosaicTileSize(rasters[0].texture->width, rasters[0].texture->height);
+	glActiveTexture(GL_TEXTURE0 + mosaicTileSlot);
+	if (!mosaicTile) {
+		mosaicTile = make_unique<FrameBuffer>(size.x, size.y);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	} else if (mosaicTile->width != size.x || mosaicTile->height != size.y) {
+		mosaicTile->resize(size.x, size.y);
+	}
+	glActiveTexture(GL_TEXTURE0);
+	return size;
+}
+// the mosaic is the same tile over and over, so it's combined once at its own resolution instead of for every screen pixel
+void renderMosaicTile(TriangleShader* triangleShader, unique_ptr<FrameBuffer>& mosaicTile, int howManyRasterTextures) {
+	glm::ivec2 size = allocateMosaicTile(mosaicTile);
+	AABB tileAabb = {0.f, 1.f, 0.f, 1.f};
+	shared_ptr<WarpMapTexture> warpMap = useWarpMapCache && !rectifyActive() ? getWarpMap(triangleShader, tileAabb, size.x, size.y) : nullptr;
+	glBindFramebuffer(GL_FRAMEBUFFER, mosaicTile->framebuffer);
+	glViewport(0, 0, size.x, size.y);
+	renderRasters(triangleShader, tileAabb, 1, size.x, size.y, howManyRasterTextures, -1, warpMap.get(), rectifyActive());
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, frameWidth, frameHeight);
+}
+// all gathered modes in one pass at 1 sample, Save too, then laid out 3 by 2 into target with the name of each on top
+void renderModeComparison(TriangleShader* triangleShader, GatherBuffer& gatherBuffer, AABB aabb, int howManyRasterTextures, unsigned int target, bool save) {
+	gatherBuffer.resize(frameWidth, frameHeight);
+	shared_ptr<WarpMapTexture> warpMap = useWarpMapCache ? getWarpMap(triangleShader, aabb, frameWidth, frameHeight) : nullptr;
+	glBindFramebuffer(GL_FRAMEBUFFER, gatherBuffer.framebuffer);
+	renderRasters(gatherModesShader(), aabb, 1, frameWidth, frameHeight, howManyRasterTextures, -1, warpMap.get(), false);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, gatherBuffer.framebuffer);
+	for (int i = 0; i < gatherModeCount; i++) {
+		glReadBuffer(GL_COLOR_ATTACHMENT0 + i);
+		if (save) { // every mode at full size too
+			vector<unsigned char> pixels((size_t)frameWidth * (size_t)frameHeight * 4);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glReadPixels(0, 0, frameWidth, frameHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+			stbi_flip_vertically_on_write(true);
+			string path = string("output_") + combineModeNames[gatherModes[i]] + ".png";
+			stbi_write_png(path.c_str(), frameWidth, frameHeight, 4, pixels.data(), frameWidth * 4);
+		}
+	}
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+	glClear(GL_COLOR_BUFFER_BIT);
+	int tileWidth = frameWidth / 3, tileHeight = frameHeight / 2;
+	int width = frameWidth / 3, height = frameHeight / 3; // a third of the frame keeps the aspect in a 3 by 2 layout
+	for (int i = 0; i < gatherModeCount; i++) {
+		int x = (i % 3) * tileWidth + (tileWidth - width) / 2;
+		int y = frameHeight - (i / 3 + 1) * tileHeight + (tileHeight - height) / 2;
+		glReadBuffer(GL_COLOR_ATTACHMENT0 + i);
+		glBlitFramebuffer(0, 0, frameWidth, frameHeight, x, y, x + width, y + height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	}
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, target);
+}
+void renderTiled(TileShader* tileShader, FrameBuffer& mosaicTile, AABB aabb) {
+	glClear(GL_COLOR_BUFFER_BIT);
+	tileShader->use();
+	glActiveTexture(GL_TEXTURE0 + mosaicTileSlot);
+	glBindTexture(GL_TEXTURE_2D, mosaicTile.textureColorBuffer);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, nearest ? GL_NEAREST : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, nearest ? GL_NEAREST : GL_LINEAR);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(tileShader->texLocation, mosaicTileSlot);
+	glUniform4f(tileShader->aabbLocation, aabb.l, aabb.r, aabb.b, aabb.t);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+	tris += 2;
+}
 const glm::mat4 identity = glm::mat4(1.f);
 const glm::mat4 fullscreenProj = glm::ortho(-0.5f, 0.5f, -0.5f, 0.5f, -1.f, 1.f);
 class Line {
@@ -630,7 +1550,159 @@ enum ClickMode {
 /*struct LensLine {
 	float x1, float y1, float x2, float y2, float x3, float y3;
 };*/
-void renderLine(Line line, ColorShader* colorShader, AABB viewAabb, bool endless) {
+// quads collected over a frame and drawn with one instanced call, each one is just a model matrix
+class OverlayBatch {
+public:
+	vector<glm::mat4> instances;
+	unsigned int vao, instanceBuffer, restoreVao;
+	OverlayBatch(unsigned int quadVbo, unsigned int quadEbo, unsigned int restoreVao) : restoreVao(restoreVao) {
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, quadVbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quadEbo);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+		glEnableVertexAttribArray(1);
+
+		glGenBuffers(1, &instanceBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		for (int i = 0; i < 4; i++) { // a mat4 attribute is 4 vec4 columns
+			glVertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(i * sizeof(glm::vec4)));
+			glEnableVertexAttribArray(2 + i);
+			glVertexAttribDivisor(2 + i, 1);
+		}
+		glBindVertexArray(restoreVao);
+	}
+	OverlayBatch(const OverlayBatch&) = delete;
+	OverlayBatch& operator=(const OverlayBatch&) = delete;
+	~OverlayBatch() {
+		glDeleteVertexArrays(1, &vao);
+		glDeleteBuffers(1, &instanceBuffer);
+	}
+	void draw(Shader* shader, unsigned int colLocation, glm::vec3 col) {
+		if (instances.empty()) return;
+		shader->use();
+		glUniform3f(colLocation, col.r, col.g, col.b);
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(glm::mat4), instances.data(), GL_STREAM_DRAW);
+		glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, (int)instances.size());
+		glBindVertexArray(restoreVao);
+		tris += 2 * (int)instances.size();
+		instances.clear();
+	}
+};
+// user lines are straight in undistorted space, so on screen they're curves through inverseTransformPoint
+// all of them live in one vertex buffer that's only rebuilt when the lines or the lens change
+class LensLineBuffer {
+public:
+	struct Vertex {
+		glm::vec2 pos, other, side;
+	};
+	unsigned int vao, vbo, restoreVao;
+	int vertexCount = 0;
+	LensLineBuffer(unsigned int restoreVao) : restoreVao(restoreVao) {
+		glGenVertexArrays(1, &vao);
+		glGenBuffers(1, &vbo);
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, pos));
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, other));
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, side));
+		glEnableVertexAttribArray(2);
+		glBindVertexArray(restoreVao);
+	}
+	LensLineBuffer(const LensLineBuffer&) = delete;
+	LensLineBuffer& operator=(const LensLineBuffer&) = delete;
+	~LensLineBuffer() {
+		glDeleteVertexArrays(1, &vao);
+		glDeleteBuffers(1, &vbo);
+	}
+	void update(const vector<Line>& lines) {
+		WarpKey key = warpKey(currentParams({0.f, 1.f, 0.f, 1.f}), 0, 0);
+		if (built && key == builtKey && sameLines(lines)) return;
+		built = true;
+		builtKey = key;
+		builtLines = lines;
+
+		// endless lines get cut where they leave the area around the image, found in undistorted space
+		const float margin = 0.5f;
+		AABB bounds = {INFINITY, -INFINITY, INFINITY, -INFINITY};
+		for (int i = 0; i <= 64; i++) {
+			float t = lerp(-margin, 1.f + margin, (float)i / 64.f);
+			glm::vec2 edge[4] = {{t, -margin}, {t, 1.f + margin}, {-margin, t}, {1.f + margin, t}};
+			for (glm::vec2 p : edge) {
+				p = transformPoint(p, true);
+				bounds = {min(bounds.l, p.x), max(bounds.r, p.x), min(bounds.b, p.y), max(bounds.t, p.y)};
+			}
+		}
+
+		vector<Vertex> vertices;
+		vector<glm::vec2> polyline;
+		for (Line line : lines) {
+			line.extendToAABB(bounds);
+			if (line.length() == 0.f) continue;
+			glm::vec2 start = glm::vec2(line.start.x, line.start.y), end = glm::vec2(line.end.x, line.end.y);
+			polyline.clear();
+			polyline.push_back(inverseTransformPoint(start));
+			subdivide(start, end, polyline.back(), inverseTransformPoint(end), 0, polyline);
+			for (size_t i = 0; i + 1 < polyline.size(); i++) {
+				glm::vec2 p = polyline[i], q = polyline[i + 1];
+				// two triangles, the far end's normal points the other way so its side flips
+				Vertex quad[6] = {
+					{p, q, {-1.f, 0.f}}, {p, q, {1.f, 1.f}}, {q, p, {1.f, 0.f}},
+					{p, q, {1.f, 1.f}}, {q, p, {-1.f, 1.f}}, {q, p, {1.f, 0.f}}
+				};
+				vertices.insert(vertices.end(), quad, quad + 6);
+			}
+		}
+		vertexCount = (int)vertices.size();
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_DYNAMIC_DRAW);
+	}
+	void draw(LensLineShader* shader, AABB viewAabb) {
+		if (vertexCount == 0) return;
+		shader->use();
+		glUniform3f(shader->colLocation, 0.f, 1.f, 1.f);
+		glUniform4f(shader->viewLocation, viewAabb.l, viewAabb.r, viewAabb.b, viewAabb.t);
+		glUniform2f(shader->resolutionLocation, (float)frameWidth, (float)frameHeight);
+		glUniform1f(shader->widthLocation, 4.f);
+		glBindVertexArray(vao);
+		glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+		glBindVertexArray(restoreVao);
+		tris += vertexCount / 3;
+	}
+private:
+	bool built = false;
+	WarpKey builtKey;
+	vector<Line> builtLines;
+
+	bool sameLines(const vector<Line>& lines) const {
+		if (lines.size() != builtLines.size()) return false;
+		for (size_t i = 0; i < lines.size(); i++) {
+			if (lines[i].start.x != builtLines[i].start.x || lines[i].start.y != builtLines[i].start.y ||
+				lines[i].end.x != builtLines[i].end.x || lines[i].end.y != builtLines[i].end.y) return false;
+		}
+		return true;
+	}
+	// halves a..b until the curve's midpoint is within a fraction of a pixel of the chord, appends the end points
+	void subdivide(glm::vec2 a, glm::vec2 b, glm::vec2 screenA, glm::vec2 screenB, int depth, vector<glm::vec2>& out) {
+		const float tolerance = 1.f / 4096.f;
+		const int minDepth = 2, maxDepth = 12; // a couple of splits first so a symmetric bend can't hide behind the midpoint
+		glm::vec2 mid = (a + b) * 0.5f;
+		glm::vec2 screenMid = inverseTransformPoint(mid);
+		if (depth < maxDepth && (depth < minDepth || glm::distance(screenMid, (screenA + screenB) * 0.5f) > tolerance)) {
+			subdivide(a, mid, screenA, screenMid, depth + 1, out);
+			subdivide(mid, b, screenMid, screenB, depth + 1, out);
+		} else {
+			out.push_back(screenB);
+		}
+	}
+};
+void renderLine(Line line, OverlayBatch& lineBatch, AABB viewAabb, bool endless) {
 	float aspect = (float)frameWidth / (float)frameHeight;
 	const float width = 8.f / (float)frameWidth;
 	Line screenSpaceLine = {transformPointFromTo(line.start, viewAabb, {-1.f, 1.f, -1.f, 1.f}), transformPointFromTo(line.end, viewAabb, {-1.f, 1.f, -1.f, 1.f})};
@@ -639,13 +1711,6 @@ void renderLine(Line line, ColorShader* colorShader, AABB viewAabb, bool endless
 		screenSpaceLine.extendToAABB({-1.f, 1.f, -1.f, 1.f});
 	}
 
-
-	colorShader->use();
-
-	glm::mat4 proj = glm::mat4(1.f);///glm::ortho(viewAabb.l, viewAabb.r, viewAabb.b, viewAabb.t, -1.f, 1.f);
-	glUniformMatrix4fv(colorShader->projLocation, 1, GL_FALSE, glm::value_ptr(proj));
-
-
 	screenSpaceLine.start.y /= aspect; // uniform width and stuff
 	screenSpaceLine.end.y /= aspect;
 	float length = screenSpaceLine.length();
@@ -656,35 +1721,23 @@ void renderLine(Line line, ColorShader* colorShader, AABB viewAabb, bool endless
 	model = glm::translate(model, glm::vec3(center.x, center.y, 0.f));
 	model = glm::rotate(model, atan((screenSpaceLine.end.x - screenSpaceLine.start.x) / (screenSpaceLine.end.y - screenSpaceLine.start.y)), glm::vec3(0.f, 0.f, -1.f));
 	model = glm::scale(model, glm::vec3(width, length, 1.f));
-
-	glUniformMatrix4fv(colorShader->modelLocation, 1, GL_FALSE, glm::value_ptr(model));
-	glUniform3f(colorShader->colLocation, 0.f, 1.f, 1.f);
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-	tris += 2;
+	lineBatch.instances.push_back(model);
 }
-void renderCircle(float x, float y, float r, CircleShader* circleShader, AABB viewAabb) {
+void renderCircle(float x, float y, float r, OverlayBatch& circleBatch, AABB viewAabb) {
 	x = invLerp(viewAabb.l, viewAabb.r, x) * 2.f - 1.f;
 	y = invLerp(viewAabb.b, viewAabb.t, y) * 2.f - 1.f;
 
-	circleShader->use();
-
-	glm::mat4 proj = glm::mat4(1.f);///glm::ortho(viewAabb.l, viewAabb.r, viewAabb.b, viewAabb.t, -1.f, 1.f);
-	glUniformMatrix4fv(circleShader->projLocation, 1, GL_FALSE, glm::value_ptr(proj));
-
 	glm::mat4 model = glm::mat4(1.f);
 	model = glm::translate(model, glm::vec3(x, y, 0.f));
 	float width = r / (float)frameWidth;
 	model = glm::scale(model, glm::vec3(width, width * (float)frameWidth / (float)frameHeight, 1.f));
-
-	glUniformMatrix4fv(circleShader->modelLocation, 1, GL_FALSE, glm::value_ptr(model));
-	glUniform3f(circleShader->colLocation, 0.5f, 1.f, 1.f);
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-	tris += 2;
+	circleBatch.instances.push_back(model);
 }
-char* dropPath = nullptr;
+vector<string> droppedPaths; // handed to the image loader by the main loop
 void drop_callback(GLFWwindow* window, int count, const char** paths) {
-    dropPath = strdup(paths[0]);
+	for (int i = 0; i < count; i++) droppedPaths.push_back(paths[i]);
 }
+void runEditor(GLFWwindow* window);
 int main(void) {
 	glfwInit();
 
@@ -732,16 +1785,69 @@ int main(void) {
 	glEnable(GL_MULTISAMPLES_NV);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-
-	TriangleShader triangleShader{"shaders/raster.vsh", "shaders/fragment.fsh"};
+	// put the window up before any shader or image work, runEditor keeps it drawing while the programs compile
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glfwSwapBuffers(window);
+
+	runEditor(window);
+	// the globals holding gl objects let go of them while the context still exists
+	rasters.clear();
+	textureCache.clear();
+	warpMapCache.clear();
+	rasterShaders.clear();
+	gatherShader.reset();
+	rectifyShader.reset();
+	TriangleShader::releaseBlockBuffer();
+	if (lensTableTexture) glDeleteTextures(1, &lensTableTexture);
+	if (warpFramebuffer) glDeleteFramebuffers(1, &warpFramebuffer);
+	ImGui_ImplOpenGL3_Shutdown(); // imgui's own font texture, program and buffers
+	ImGui_ImplGlfw_Shutdown();
+	ImGui::DestroyContext();
+	glfwTerminate();
+	return 0;
+}
+// everything from the shaders to the main loop, its locals own gl objects so they have to be gone before glfwTerminate
+void runEditor(GLFWwindow* window) {
+	ImGuiIO& io = ImGui::GetIO();
+	// without cached program binaries every program compiles here, so a frame saying which one goes up before each
+	// instead of the window staying black. no vsync meanwhile, with a warm cache these frames shouldn't cost anything
+	glfwSwapInterval(0);
+	auto compiling = [&](const char* name) {
+		glfwPollEvents();
+		ImGui_ImplOpenGL3_NewFrame();
+		ImGui_ImplGlfw_NewFrame();
+		ImGui::NewFrame();
+		ImGui::Begin("Raster Doer");
+		ImGui::Text("compiling %s...", name);
+		ImGui::End();
+		ImGui::Render();
+		glClear(GL_COLOR_BUFFER_BIT);
+		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+		glfwSwapBuffers(window);
+	};
+	compiling("difference.fsh");
 	DifferenceShader differenceShader{"shaders/vertex.vsh", "shaders/difference.fsh"};
+	compiling("outline.fsh");
 	OutlineShader outlineShader{"shaders/vertex.vsh", "shaders/outline.fsh"};
-	ColorShader colorShader{"shaders/vertex.vsh", "shaders/color.fsh"};
-	CircleShader circleShader{"shaders/vertex.vsh", "shaders/circle.fsh"};
+	compiling("color.fsh");
+	ColorShader colorShader{"shaders/instanced.vsh", "shaders/color.fsh"};
+	compiling("circle.fsh");
+	CircleShader circleShader{"shaders/instanced.vsh", "shaders/circle.fsh"};
+	compiling("lensline.vsh");
+	LensLineShader lensLineShader{"shaders/lensline.vsh", "shaders/color.fsh"};
+	compiling("tile.fsh");
+	TileShader tileShader{"shaders/raster.vsh", "shaders/tile.fsh"};
+	compiling("fragment.fsh");
+	rasterShader(1); // the variant for the starting settings, the biggest of them all
+	glfwSwapInterval(1);
 
 	shared_ptr<Texture> rasterTextures[] = {
-		make_shared<Texture>("images/IMG_7843-2nointerpolatoin.jpg")
+		make_shared<Texture>()
 	};
+	ImageLoader imageLoader(2);
+	imageLoader.queue("images/IMG_7843-2nointerpolatoin.jpg"); // the placeholder shows until it's decoded and uploaded
+	const size_t uploadBytesPerFrame = (size_t)16 << 20; // an 8k photo is 128mb of rgba, this spreads it over a few frames
 	int howManyRasterTextures = sizeof(rasterTextures) / sizeof(shared_ptr<Texture>);
 
 	frameWidth = 640;
@@ -749,6 +1855,17 @@ int main(void) {
 	glfwSetWindowSize(window, frameWidth, frameHeight);
 
 	FrameBuffer renderBuffer(frameWidth, frameHeight);
+	GatherBuffer gatherBuffer;
+	RasterKey renderBufferKey;
+	bool renderBufferValid = false;
+	CellAccumulation cellAccumulation;
+	const double accumulateFrameMs = 30.; // gpu time per frame the accumulation may take
+	int busyFrames = 0; // frames left to draw before waiting for events, imgui needs a couple to settle after input
+	unique_ptr<FrameBuffer> mosaicTile;
+	RasterKey mosaicTileKey;
+	bool mosaicTileOnce = true;
+	bool tileAccumulating = false; // cellAccumulation is filling mosaicTile rather than the view and isn't done
+	unique_ptr<FrameBuffer> tilePreview; // mosaicTile plus the raster still accumulating, what's shown until it's done
 
 	//buffers
 	unsigned int VBO, EBO, VAO;
@@ -790,6 +1907,9 @@ int main(void) {
 	}
 
 	glBindVertexArray(VAO);
+	OverlayBatch lineBatch(VBO, EBO, VAO);
+	OverlayBatch circleBatch(VBO, EBO, VAO);
+	LensLineBuffer lensLines(VAO);
 
 	vector<Line> lines;
 	vector<Point> referencePoints;
@@ -808,15 +1928,38 @@ int main(void) {
 	AABB viewAabb = {0.f, 1.f, 0.f, 1.f};
 	
 	// dropdown menu imgui
-	const char* combineModeItems[] = {"mean (best for noise)", "median (best for single differences)", "single", "mode", "mad", "voronoi (best for low res without noise)"};
+	const char* combineModeItems[] = {"mean (best for noise)", "median (best for single differences)", "single", "mode", "mad", "voronoi (best for low res without noise)", "percentile", "standard deviation", "coefficient of variation", "trimmed mean"};
 	int currentCombineModeItemNumber = 0;
 	//llooop
 	while (!glfwWindowShouldClose(window)) {
 		// drop image
-		if (dropPath != nullptr) {
-			rasterTextures[0] = make_shared<Texture>(dropPath);
-			dropPath = nullptr;
+		shared_ptr<Texture> shown;
+		for (const string& path : droppedPaths) {
+			shared_ptr<Texture> cached = textureCache.find(path);
+			if (cached) shown = cached;
+			else imageLoader.queue(path);
+		}
+		droppedPaths.clear();
+		if (shared_ptr<Texture> loaded = imageLoader.step(uploadBytesPerFrame)) {
+			textureCache.insert(loaded->path, loaded, loaded->size());
+			shown = loaded;
 		}
+		if (shown && shown != rasterTextures[0]) {
+			rasterTextures[0] = shown;
+			for (Raster& raster : rasters) { // the old texture is freed once nothing holds it
+				raster.texture = shown;
+				raster.rectified.reset(); // its key could match again through a reused texture id
+			}
+			shown->slot = 0;
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, shown->id);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, nearest ? GL_NEAREST : GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, nearest ? GL_NEAREST : GL_LINEAR);
+			renderBufferValid = false; // the new texture can get the freed one's id
+			mosaicTile.reset();
+			warpMapCache.clear(); // the voronoi map was picked at the old image's resolution
+		}
+		if (imageLoader.uploadReady()) busyFrames = 2;
 
 		controls.mouseX = mouseX / (double)frameWidth * (double)(viewAabb.r - viewAabb.l) + viewAabb.l;
 		controls.mouseY = mouseY / (double)frameHeight * (double)(viewAabb.t - viewAabb.b) + viewAabb.b;
@@ -957,7 +2100,104 @@ int main(void) {
 			//h = frameHeight * 2;// * (viewAabb.t - viewAabb.b);
 			//glViewport(0, 0, w, h);
 		}
-		renderRasters(&triangleShader, viewAabb, save ? 3 : 1, frameWidth, frameHeight, howManyRasterTextures, -1);
+		if (ddo) {
+			trans = transform2d(transformQuad[0].x, transformQuad[0].y, transformQuad[1].x, transformQuad[1].y, transformQuad[2].x, transformQuad[2].y, transformQuad[3].x, transformQuad[3].y);
+			inverseTrans = glm::inverse(trans);
+		}
+		updateLensModel();
+		updateLensTable();
+		// the rasters only get rendered when something they depend on changed, otherwise the last frame is copied back
+		RasterKey key = rasterKey(viewAabb, frameWidth, frameHeight, mosaicTileOnce, rasterTextures[0]->id);
+		bool rasterDirty = save || !renderBufferValid || !(key == renderBufferKey);
+		if (rasterDirty) {
+			if (renderBuffer.width != frameWidth || renderBuffer.height != frameHeight) renderBuffer.resize(frameWidth, frameHeight);
+			unsigned int target = save ? 0 : renderBuffer.framebuffer; // saving reads the back buffer
+			TriangleShader* combineShader = rasterShader(save ? saveAaRes : 1);
+			// saving and the mosaic tile rendered once for every view keep full resolution, the rest samples the level that fits
+			bool fullResolution = save || (mosaicTileOnce && combineMosaic && !compareModes);
+			for (Raster& raster : rasters) raster.texture->useLevel(fullResolution ? 0 : previewLevel(*raster.texture, viewAabb, frameWidth, frameHeight));
+			// whatever was still running is stale now, unless it's the tile and only the view moved
+			bool tileRunning = tileAccumulating, tileKept = false;
+			cellAccumulation.active = false;
+			tileAccumulating = false;
+			if (compareModes && combineMosaic && !rasters.empty()) {
+				renderModeComparison(combineShader, gatherBuffer, viewAabb, howManyRasterTextures, target, save);
+			} else if (mosaicTileOnce && combineMosaic && !save && !rasters.empty()) {
+				// the tile doesn't depend on the view, panning and zooming only show it again
+				glm::ivec2 tileSize = mosaicTileSize(rasters[0].texture->width, rasters[0].texture->height);
+				RasterKey tileKey = rasterKey({0.f, 1.f, 0.f, 1.f}, tileSize.x, tileSize.y, true, rasterTextures[0]->id);
+				if (!mosaicTile || !(tileKey == mosaicTileKey)) {
+					tileAccumulating = accumulationActive(1);
+					if (tileAccumulating) { // a big grid's tile is one long draw too, so it's summed over frames like the view
+						glm::ivec2 size = allocateMosaicTile(mosaicTile);
+						shared_ptr<WarpMapTexture> warpMap = useWarpMapCache ? getWarpMap(combineShader, {0.f, 1.f, 0.f, 1.f}, size.x, size.y) : nullptr;
+						glBindFramebuffer(GL_FRAMEBUFFER, mosaicTile->framebuffer);
+						glClear(GL_COLOR_BUFFER_BIT);
+						cellAccumulation.start({0.f, 1.f, 0.f, 1.f}, 1, size.x, size.y, warpMap);
+					} else {
+						renderMosaicTile(combineShader, mosaicTile, howManyRasterTextures);
+					}
+					mosaicTileKey = tileKey;
+				} else if (tileRunning) {
+					cellAccumulation.active = true;
+					tileAccumulating = true;
+				}
+				tileKept = true;
+				glBindFramebuffer(GL_FRAMEBUFFER, target);
+				renderTiled(&tileShader, *mosaicTile, viewAabb);
+			} else if (accumulationActive(save ? saveAaRes : 1)) {
+				shared_ptr<WarpMapTexture> warpMap = useWarpMapCache && !save ? getWarpMap(combineShader, viewAabb, frameWidth, frameHeight) : nullptr;
+				glBindFramebuffer(GL_FRAMEBUFFER, renderBuffer.framebuffer);
+				glClear(GL_COLOR_BUFFER_BIT);
+				cellAccumulation.start(viewAabb, save ? saveAaRes : 1, frameWidth, frameHeight, warpMap);
+				if (save) { // all at once, still in short draws, then onto the back buffer that gets read
+					cellAccumulation.step(INFINITY, renderBuffer.framebuffer);
+					glBindFramebuffer(GL_READ_FRAMEBUFFER, renderBuffer.framebuffer);
+					glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+					glBlitFramebuffer(0, 0, frameWidth, frameHeight, 0, 0, frameWidth, frameHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+					glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+				}
+			} else {
+				// the warp map only holds pixel centers, saving supersamples so it warps per sample
+				shared_ptr<WarpMapTexture> warpMap = useWarpMapCache && !save && !rectifyActive() ? getWarpMap(combineShader, viewAabb, frameWidth, frameHeight) : nullptr;
+				glBindFramebuffer(GL_FRAMEBUFFER, target);
+				renderRasters(combineShader, viewAabb, save ? saveAaRes : 1, frameWidth, frameHeight, howManyRasterTextures, -1, warpMap.get(), rectifyActive());
+			}
+			if (tileRunning && !tileKept) mosaicTile.reset(); // left half summed, it starts over next time it's shown
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			renderBufferKey = key;
+			renderBufferValid = !save;
+			busyFrames = 2;
+		}
+		if (!save && cellAccumulation.active && tileAccumulating) {
+			// the tile so far: finished rasters are in mosaicTile, the running one is previewed over a copy and tiled into the view
+			if (cellAccumulation.step(accumulateFrameMs, mosaicTile->framebuffer)) tileAccumulating = false;
+			FrameBuffer* shownTile = mosaicTile.get();
+			if (cellAccumulation.active) {
+				glm::ivec2 size = allocateMosaicTile(tilePreview);
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, mosaicTile->framebuffer);
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, tilePreview->framebuffer);
+				glBlitFramebuffer(0, 0, size.x, size.y, 0, 0, size.x, size.y, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+				glViewport(0, 0, size.x, size.y);
+				cellAccumulation.preview();
+				glViewport(0, 0, frameWidth, frameHeight);
+				shownTile = tilePreview.get();
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, renderBuffer.framebuffer);
+			renderTiled(&tileShader, *shownTile, viewAabb);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			busyFrames = 2;
+		} else if (!save && cellAccumulation.active) { // a slice of the big reduction per frame, the rest waits for the next one
+			cellAccumulation.step(accumulateFrameMs, renderBuffer.framebuffer);
+			busyFrames = 2;
+		}
+		if (!save) {
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, renderBuffer.framebuffer);
+			glBlitFramebuffer(0, 0, frameWidth, frameHeight, 0, 0, frameWidth, frameHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+			if (!tileAccumulating) cellAccumulation.preview();
+		}
 		if (save) {
 			GLsizei stride = w * 4;
 			GLsizei bufferSize = stride * h;
@@ -978,35 +2218,22 @@ int main(void) {
 			lines.push_back({{lineStartPoint.x, lineStartPoint.y}, {x, y}});
 		}
 		// render lines
-		for (unsigned int i = 0U; i < lines.size(); i++) {
-			Line line = lines.at(i);
-
-			glm::vec2 one = glm::vec2(line.start.x, line.start.y);
-			one = inverseTransformPoint(one);
-			line.start.x = one.x;
-			line.start.y = one.y;
-
-			glm::vec2 two = glm::vec2(line.end.x, line.end.y);
-			two = inverseTransformPoint(two);
-			line.end.x = two.x;
-			line.end.y = two.y;
-
-			renderLine(line, &colorShader, viewAabb, true);
-		}
+		lensLines.update(lines);
+		lensLines.draw(&lensLineShader, viewAabb);
 		// rener reference points
 		for (unsigned int i = 0U; i < referencePoints.size(); i++) {
 			glm::vec2 point = glm::vec2(referencePoints.at(i).x, referencePoints.at(i).y);
 			point = inverseTransformPoint(point);
 
-			renderCircle(point.x, point.y, 20.f, &circleShader, viewAabb);
+			renderCircle(point.x, point.y, 20.f, circleBatch, viewAabb);
 		}
 
 		//render perspective grid
 		if (!showTransform) {
 			for (int i = 0; i < 4; i++) {
 				Line line = {{transformQuad[i].x, transformQuad[i].y}, {transformQuad[(i + 1) % 4].x, transformQuad[(i + 1) % 4].y}};
-				renderLine(line, &colorShader, viewAabb, false);
-				renderCircle(transformQuad[i].x, transformQuad[i].y, 30.f, &circleShader, viewAabb);
+				renderLine(line, lineBatch, viewAabb, false);
+				renderCircle(transformQuad[i].x, transformQuad[i].y, 30.f, circleBatch, viewAabb);
 			}
 			for (int x = 1; x < gridX; x++) {
 				float t = (float)x / (float)gridX;
@@ -1017,7 +2244,7 @@ int main(void) {
 				two = trans * two;
 
 				Line line = {{one.x / one.z, one.y / one.z}, {two.x / two.z, two.y / two.z}};
-				renderLine(line, &colorShader, viewAabb, false);
+				renderLine(line, lineBatch, viewAabb, false);
 			}
 			for (int y = 1; y < gridY; y++) {
 				float t = (float)y / (float)gridY;
@@ -1028,10 +2255,13 @@ int main(void) {
 				two = trans * two;
 
 				Line line = {{one.x / one.z, one.y / one.z}, {two.x / two.z, two.y / two.z}};
-				renderLine(line, &colorShader, viewAabb, false);
+				renderLine(line, lineBatch, viewAabb, false);
 			}
 		}
 
+		lineBatch.draw(&colorShader, colorShader.colLocation, glm::vec3(0.f, 1.f, 1.f));
+		circleBatch.draw(&circleShader, circleShader.colLocation, glm::vec3(0.5f, 1.f, 1.f));
+
 		if (clickMode == CM_LINE_END) {
 			lines.pop_back();
 		}
@@ -1040,8 +2270,29 @@ int main(void) {
 
 		ImGui::Begin("Raster Doer");
 		ImGui::Text("%d FPS %f", fps, dt);
+		if (imageLoader.pending() > 0) {
+			ImGui::Text("loading %d image%s", imageLoader.pending(), imageLoader.pending() == 1 ? "" : "s");
+			ImGui::SameLine();
+			ImGui::ProgressBar(imageLoader.progress(), ImVec2(-1.f, 0.f));
+		}
 		ImGui::Text("%d", tris);
+		ImGui::SameLine();
+		ImGui::Text(rasterDirty ? "rendered" : "cached");
 		if (ImGui::Button("Save")) save = true;
+		ImGui::SameLine();
+		ImGui::SetNextItemWidth(80.f);
+		ImGui::SliderInt("AA", &saveAaRes, 1, 8);
+		ImGui::SameLine();
+		ImGui::SetNextItemWidth(90.f);
+		ImGui::Combo("##aaPattern", &aaPattern, aaPatternNames, IM_ARRAYSIZE(aaPatternNames));
+		ImGui::SameLine();
+		ImGui::Checkbox("Adaptive", &aaAdaptive);
+		if (aaAdaptive) {
+			ImGui::SameLine();
+			ImGui::SetNextItemWidth(80.f);
+			ImGui::SliderFloat("##aaThreshold", &aaThreshold, 0.f, 0.25f);
+		}
+		if (compareModes && combineMosaic) ImGui::Text("compare modes saves every mode at 1 sample, AA doesn't apply");
 		if (ImGui::CollapsingHeader("stats and stuff")) {
 			ImGui::Text("View %f %f %f %f", viewAabb.l, viewAabb.r, viewAabb.b, viewAabb.t);
 			ImGui::Text("Mouse %f %f", controls.mouseX, controls.mouseY);
@@ -1053,21 +2304,22 @@ int main(void) {
 			clickMode = CM_REFERENCEPOINT;
 		}
 		if (ImGui::Button("Align")) {
-			glm::vec2 bl = glm::vec2(-ratio, -1.f);;
+			glm::vec2 bl = glm::vec2(-aspectRatio, -1.f);;
 			float r = glm::length(bl);
-			r = lensDistortion(r, a, b, c, d);
-			bl = glm::normalize(bl) * r;
-			viewAabb.l = bl.x * 0.5f / ratio + 0.5f;
-			viewAabb.b = bl.y * 0.5f + 0.5f;
-
-			glm::vec2 tr = glm::vec2(ratio, 1.f);
-			r = glm::length(tr);
-			r = lensDistortion(r, a, b, c, d);
-			tr = glm::normalize(tr) * r;
-			viewAabb.r = tr.x * 0.5f / ratio + 0.5f;
-			viewAabb.t = tr.y * 0.5f + 0.5f;
-		}
-		static bool nearest = true;
+			r = lensForward(r, currentParams(viewAabb));
+			if (r < lensOutside) { // the corners are past what the lens model reaches otherwise, so the view stays
+				bl = glm::normalize(bl) * r;
+				viewAabb.l = bl.x * 0.5f / aspectRatio + 0.5f;
+				viewAabb.b = bl.y * 0.5f + 0.5f;
+
+				glm::vec2 tr = glm::vec2(aspectRatio, 1.f);
+				r = glm::length(tr);
+				r = lensForward(r, currentParams(viewAabb));
+				tr = glm::normalize(tr) * r;
+				viewAabb.r = tr.x * 0.5f / aspectRatio + 0.5f;
+				viewAabb.t = tr.y * 0.5f + 0.5f;
+			}
+		}
 		if (ImGui::Checkbox("Nearest", &nearest)) {
 			for (int i = 0; i < howManyRasterTextures; i++) {
 				glBindTexture(GL_TEXTURE_2D, rasterTextures[i]->id);
@@ -1075,9 +2327,10 @@ int main(void) {
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, nearest ? GL_NEAREST : GL_LINEAR);
 			}
 		}
+		ImGui::SameLine();
+		if (ImGui::Button("Save recipe")) saveRecipe("recipe.txt", currentRecipe(viewAabb)); // for rasterbatch
 		if (ImGui::BeginCombo("##combo", combineModeItems[currentCombineModeItemNumber])) {
 			for (int n = 0; n < IM_ARRAYSIZE(combineModeItems); n++) {
-				if (n == 1) continue;;
 				bool is_selected = currentCombineModeItemNumber == n;
 				if (ImGui::Selectable(combineModeItems[n], is_selected)) {
 					combineMode = n;
@@ -1087,8 +2340,31 @@ int main(void) {
 			}
 			ImGui::EndCombo();
 		}
+		if (combineMode == 6) ImGui::SliderFloat("Percentile", &percentile, 0.f, 1.f);
 		ImGui::Checkbox("Show transform", &showTransform);
 		ImGui::Checkbox("Combine mosaic", &combineMosaic);
+		ImGui::SameLine();
+		ImGui::Checkbox("Render tile once", &mosaicTileOnce);
+		ImGui::Checkbox("Accumulate big grids", &accumulateCells);
+		if (cellAccumulation.active) {
+			ImGui::SameLine();
+			ImGui::ProgressBar(cellAccumulation.progress(), ImVec2(-1.f, 0.f));
+		}
+		ImGui::SameLine();
+		ImGui::Checkbox("Compare modes", &compareModes);
+		if (compareModes && combineMosaic) { // names over the tiles renderModeComparison lays out
+			int tileWidth = frameWidth / 3, tileHeight = frameHeight / 2;
+			for (int i = 0; i < gatherModeCount; i++) {
+				float x = (float)((i % 3) * tileWidth + (tileWidth - frameWidth / 3) / 2);
+				float y = (float)((i / 3) * tileHeight + (tileHeight - frameHeight / 3) / 2);
+				ImVec2 position = ImVec2(x / io.DisplayFramebufferScale.x + 4.f, y / io.DisplayFramebufferScale.y + 4.f);
+				ImGui::GetForegroundDrawList()->AddText(position, IM_COL32(255, 255, 255, 255), combineModeNames[gatherModes[i]]);
+			}
+		}
+		if (combineMosaic && mosaicTileOnce && mosaicTile) {
+			ImGui::SameLine();
+			ImGui::Text("%dx%d", mosaicTile->width, mosaicTile->height);
+		}
 		int* grid[] = {&gridX, &gridY};
 		ImGui::SliderInt2("Grid res", *grid, 1, 30);
 		ImGui::SliderInt("Grid num", &gridNumber, 0, gridX * gridY - 1);
@@ -1099,7 +2375,39 @@ int main(void) {
 		static bool random = false;
 		ImGui::Checkbox("Rand", &random);
 		if (yes) gridNumber = random ? rand() % (gridX * gridY) : (gridNumber + 1) % (gridX * gridY);
+		const char* lensModelItems[] = {"polynomial (newton)", "division", "inverse polynomial"};
+		if (ImGui::Combo("Lens model", &lensModel.type, lensModelItems, IM_ARRAYSIZE(lensModelItems))) {
+			lensModel = fitLensModel(lensModel.type, a, b, c, d, binarySearchIterations, lensTableRange(aspectRatio)); // start from the current sliders
+		}
+		if (lensModel.type == LENS_DIVISION && ImGui::SliderFloat("k", &lensModel.k, -0.5f, 0.5f)) {
+			lensModel.maxError = lensModelError(lensModel, a, b, c, d, binarySearchIterations, lensTableRange(aspectRatio));
+		}
+		if (lensModel.type != LENS_POLYNOMIAL) ImGui::Text("fit max error %g", lensModel.maxError);
 		ImGui::SliderInt("Lens iterations", &binarySearchIterations, 1, 50);
+		ImGui::Checkbox("Lens table", &useLensTable);
+		ImGui::Checkbox("Rectify first", &rectifyMosaic);
+		if (rectifyMosaic) {
+			ImGui::SameLine();
+			ImGui::SliderFloat("Density", &rectifyDensity, 0.25f, 4.f);
+			if (!rasters.empty() && rasters[0].rectified) ImGui::Text("rectified %dx%d", rasters[0].rectified->width, rasters[0].rectified->height);
+		}
+		ImGui::Checkbox("Warp cache", &useWarpMapCache);
+		ImGui::SameLine();
+		static int warpMapBudgetMb = 256;
+		if (ImGui::SliderInt("MB", &warpMapBudgetMb, 0, 2048)) warpMapCache.setBudget((size_t)warpMapBudgetMb << 20);
+		ImGui::Text("warp cache %d maps, %.1f MB", (int)warpMapCache.size(), (double)warpMapCache.used / 1048576.);
+		static int textureBudgetMb = 1024;
+		if (ImGui::SliderInt("MB##images", &textureBudgetMb, 0, 8192)) textureCache.setBudget((size_t)textureBudgetMb << 20);
+		ImGui::Text("image cache %d images, %.1f MB, %.1f MB on the gpu", (int)textureCache.size(), (double)textureCache.used / 1048576., (double)Texture::residentBytes / 1048576.);
+		if (rasterTextures[0]->level > 0) {
+			glm::ivec2 sampled = rasterTextures[0]->sampledSize();
+			ImGui::Text("preview at mip %d, %dx%d", rasterTextures[0]->level, sampled.x, sampled.y);
+		}
+		if (useLensTable) {
+			ImGui::SameLine();
+			if (lensTable.valid) ImGui::Text("%d entries, sampled max error %g", (int)lensTable.values.size(), lensTable.sampledError);
+				else ImGui::Text("too inaccurate, using newton");
+		}
 		//ImGui::Text("%f %f %f %f", aabb[0], aabb[1], aabb[2], aabb[3]);
 		ImGui::SliderFloat("a", &a, 0.f, 0.2f);
 		ImGui::SliderFloat("b", &b, 0.f, 0.2f);
@@ -1181,16 +2489,24 @@ int main(void) {
 		ImGui::SliderFloat2("3", *p3, 0.f, 1.f);
 		ImGui::SliderFloat2("4", *p4, 0.f, 1.f);
 
-		ImGui::SliderFloat("ratio", &ratio, 0.5f, 2.f);
+		ImGui::SliderFloat("ratio", &aspectRatio, 0.5f, 2.f);
 		ImGui::End();
 
 		ImGui::Render();
 		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
 		glfwSwapBuffers(window);
-		dt = glfwGetTime() - last;
+		dt = min(glfwGetTime() - last, 0.1); // waiting for events would make the first arrow key step huge
 		last = glfwGetTime();
-		glfwPollEvents();
+		// nothing moves on its own, so sleep until there's input instead of redrawing at vsync
+		bool animating = yes || controls.left || controls.right || controls.down || controls.up || selectedQuadPoint != -1;
+		if (animating || busyFrames > 0) {
+			glfwPollEvents();
+			busyFrames--;
+		} else {
+			glfwWaitEvents();
+			busyFrames = 2;
+		}
 
 		frameCount++;
 		double frameTime = glfwGetTime();
@@ -1200,6 +2516,7 @@ int main(void) {
 			frameCount = 0;
 		}
 	}
-	glfwTerminate();
-	return 0;
+	glDeleteVertexArrays(1, &VAO);
+	glDeleteBuffers(1, &VBO);
+	glDeleteBuffers(1, &EBO);
 }
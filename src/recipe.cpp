@@ -0,0 +1,139 @@
+#include "engine.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+
+using namespace std;
+
+// recipes are plain "key value..." lines, # starts a comment
+bool loadRecipe(const char* path, Recipe& recipe) {
+	ifstream file(path);
+	if (!file) {
+		cout << "[ERROR] failed to open recipe \"" << path << "\"" << endl;
+		return false;
+	}
+	RenderParams& p = recipe.params;
+	string line;
+	int lineNumber = 0;
+	bool hasDivisionK = false, hasInverseCoefficients = false;
+	while (getline(file, line)) {
+		lineNumber++;
+		line = line.substr(0, line.find('#'));
+		stringstream stream(line);
+		string key;
+		if (!(stream >> key)) continue;
+
+		if (key == "a") stream >> p.a;
+		else if (key == "b") stream >> p.b;
+		else if (key == "c") stream >> p.c;
+		else if (key == "d") stream >> p.d;
+		else if (key == "ratio") stream >> p.ratio;
+		else if (key == "iterations") stream >> p.binarySearchIterations;
+		else if (key == "transformQuad") {
+			for (glm::vec2& point : recipe.transformQuad) stream >> point.x >> point.y;
+		}
+		else if (key == "showTransform") stream >> p.showTransform;
+		else if (key == "combineMosaic") stream >> p.combineMosaic;
+		else if (key == "combineMode") stream >> p.combineMode;
+		else if (key == "percentile") stream >> p.percentile;
+		else if (key == "grid") stream >> p.gridX >> p.gridY;
+		else if (key == "gridNumber") stream >> p.gridNumber;
+		else if (key == "view") stream >> p.aabb.l >> p.aabb.r >> p.aabb.b >> p.aabb.t;
+		else if (key == "nearest") stream >> p.nearest;
+		else if (key == "size") stream >> recipe.width >> recipe.height;
+		else if (key == "lensTable") stream >> recipe.useLensTable;
+		else if (key == "lensModel") {
+			string name;
+			stream >> name;
+			p.lens.type = -1;
+			for (int i = 0; i < 3; i++) if (name == lensModelNames[i]) p.lens.type = i;
+			if (p.lens.type == -1) {
+				cout << "[ERROR] " << path << ":" << lineNumber << " unknown lens model \"" << name << "\"" << endl;
+				return false;
+			}
+		}
+		else if (key == "aa") stream >> p.aaRes;
+		else if (key == "aaPattern") {
+			string name;
+			stream >> name;
+			p.aaPattern = -1;
+			for (int i = 0; i < 3; i++) if (name == aaPatternNames[i]) p.aaPattern = i;
+			if (p.aaPattern == -1) {
+				cout << "[ERROR] " << path << ":" << lineNumber << " unknown aa pattern \"" << name << "\"" << endl;
+				return false;
+			}
+		}
+		else if (key == "aaAdaptive") stream >> p.aaAdaptive >> p.aaThreshold;
+		else if (key == "divisionK") {
+			stream >> p.lens.k;
+			hasDivisionK = true;
+		}
+		else if (key == "inverseCoefficients") {
+			stream >> p.lens.inverse.x >> p.lens.inverse.y >> p.lens.inverse.z >> p.lens.inverse.w;
+			hasInverseCoefficients = true;
+		}
+		else {
+			cout << "[ERROR] " << path << ":" << lineNumber << " unknown recipe key \"" << key << "\"" << endl;
+			return false;
+		}
+		if (stream.fail()) {
+			cout << "[ERROR] " << path << ":" << lineNumber << " bad value for \"" << key << "\"" << endl;
+			return false;
+		}
+	}
+	if (p.gridX < 1 || p.gridY < 1) {
+		cout << "[ERROR] " << path << " grid must be at least 1 1" << endl;
+		return false;
+	}
+	p.gridNumber = min(max(p.gridNumber, 0), p.gridX * p.gridY - 1);
+	p.aaRes = min(max(p.aaRes, 1), 8);
+	p.percentile = min(max(p.percentile, 0.f), 1.f);
+	// old recipes only have a,b,c,d, so a closed form model asked for without coefficients gets fitted to them
+	// only the selected model's own key counts, inverseCoefficients don't make a division recipe
+	bool hasLensCoefficients = p.lens.type == LENS_DIVISION ? hasDivisionK : p.lens.type == LENS_INVERSE_POLYNOMIAL && hasInverseCoefficients;
+	if (p.lens.type != LENS_POLYNOMIAL && !hasLensCoefficients) {
+		p.lens = fitLensModel(p.lens.type, p.a, p.b, p.c, p.d, p.binarySearchIterations, lensTableRange(p.ratio));
+		cout << "[INFO] fitted " << lensModelNames[p.lens.type] << " lens model to a b c d, max error " << p.lens.maxError << endl;
+	}
+	const glm::vec2* q = recipe.transformQuad;
+	p.trans = transform2d(q[0].x, q[0].y, q[1].x, q[1].y, q[2].x, q[2].y, q[3].x, q[3].y);
+	return true;
+}
+bool saveRecipe(const char* path, const Recipe& recipe) {
+	ofstream file(path);
+	if (!file) {
+		cout << "[ERROR] failed to write recipe \"" << path << "\"" << endl;
+		return false;
+	}
+	const RenderParams& p = recipe.params;
+	file.precision(9);
+	file << "a " << p.a << "\n";
+	file << "b " << p.b << "\n";
+	file << "c " << p.c << "\n";
+	file << "d " << p.d << "\n";
+	file << "ratio " << p.ratio << "\n";
+	file << "iterations " << p.binarySearchIterations << "\n";
+	file << "transformQuad";
+	for (const glm::vec2& point : recipe.transformQuad) file << " " << point.x << " " << point.y;
+	file << "\n";
+	file << "showTransform " << p.showTransform << "\n";
+	file << "combineMosaic " << p.combineMosaic << "\n";
+	file << "combineMode " << p.combineMode << "\n";
+	if (p.combineMode == 6) file << "percentile " << p.percentile << "\n";
+	file << "grid " << p.gridX << " " << p.gridY << "\n";
+	file << "gridNumber " << p.gridNumber << "\n";
+	file << "view " << p.aabb.l << " " << p.aabb.r << " " << p.aabb.b << " " << p.aabb.t << "\n";
+	file << "nearest " << p.nearest << "\n";
+	file << "size " << recipe.width << " " << recipe.height << "\n";
+	file << "lensTable " << recipe.useLensTable << "\n";
+	file << "lensModel " << lensModelNames[p.lens.type] << "\n";
+	file << "aa " << p.aaRes << "\n";
+	file << "aaPattern " << aaPatternNames[p.aaPattern] << "\n";
+	file << "aaAdaptive " << p.aaAdaptive << " " << p.aaThreshold << "\n";
+	if (p.lens.type == LENS_DIVISION) file << "divisionK " << p.lens.k << "\n";
+	if (p.lens.type == LENS_INVERSE_POLYNOMIAL) file << "inverseCoefficients " << p.lens.inverse.x << " " << p.lens.inverse.y << " " << p.lens.inverse.z << " " << p.lens.inverse.w << "\n";
+	return true;
+}
@@ -0,0 +1,369 @@
+// mode switches without refetching: the warp and the texel fetches of a tile are kept, cell major,
+// and every cheap combine runs as a reduction over whole cell planes, 4 pixels per step with sse2/neon
+// every lane does the same float operations in the same order as combineFetched (no fma, see CMakeLists.txt),
+// so the output is byte identical to renderImage
+#include "samplecache.h"
+
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SAMPLES_SSE2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SAMPLES_NEON 1
+#endif
+
+using namespace std;
+
+// the handful of lane operations the reductions need, tiles are a multiple of 4 pixels so there's never a tail
+#if defined(SAMPLES_SSE2)
+struct Lanes {
+	typedef __m128 Type;
+	static const int width = 4;
+	static Type load(const float* p) { return _mm_loadu_ps(p); }
+	static void store(float* p, Type v) { _mm_storeu_ps(p, v); }
+	static Type set(float x) { return _mm_set1_ps(x); }
+	static Type add(Type a, Type b) { return _mm_add_ps(a, b); }
+	static Type sub(Type a, Type b) { return _mm_sub_ps(a, b); }
+	static Type mul(Type a, Type b) { return _mm_mul_ps(a, b); }
+	static Type div(Type a, Type b) { return _mm_div_ps(a, b); }
+	static Type min(Type a, Type b) { return _mm_min_ps(a, b); }
+	static Type max(Type a, Type b) { return _mm_max_ps(a, b); }
+	static Type sqrt(Type a) { return _mm_sqrt_ps(a); }
+	static Type abs(Type a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+	// a < b ? x : y
+	static Type lessSelect(Type a, Type b, Type x, Type y) {
+		Type less = _mm_cmplt_ps(a, b);
+		return _mm_or_ps(_mm_and_ps(less, x), _mm_andnot_ps(less, y));
+	}
+};
+#elif defined(SAMPLES_NEON)
+struct Lanes {
+	typedef float32x4_t Type;
+	static const int width = 4;
+	static Type load(const float* p) { return vld1q_f32(p); }
+	static void store(float* p, Type v) { vst1q_f32(p, v); }
+	static Type set(float x) { return vdupq_n_f32(x); }
+	static Type add(Type a, Type b) { return vaddq_f32(a, b); }
+	static Type sub(Type a, Type b) { return vsubq_f32(a, b); }
+	static Type mul(Type a, Type b) { return vmulq_f32(a, b); }
+	static Type div(Type a, Type b) { return vdivq_f32(a, b); }
+	static Type min(Type a, Type b) { return vminq_f32(a, b); }
+	static Type max(Type a, Type b) { return vmaxq_f32(a, b); }
+	static Type sqrt(Type a) { return vsqrtq_f32(a); }
+	static Type abs(Type a) { return vabsq_f32(a); }
+	static Type lessSelect(Type a, Type b, Type x, Type y) { return vbslq_f32(vcltq_f32(a, b), x, y); }
+};
+#else
+struct Lanes {
+	typedef float Type;
+	static const int width = 1;
+	static Type load(const float* p) { return *p; }
+	static void store(float* p, Type v) { *p = v; }
+	static Type set(float x) { return x; }
+	static Type add(Type a, Type b) { return a + b; }
+	static Type sub(Type a, Type b) { return a - b; }
+	static Type mul(Type a, Type b) { return a * b; }
+	static Type div(Type a, Type b) { return a / b; }
+	static Type min(Type a, Type b) { return b < a ? b : a; }
+	static Type max(Type a, Type b) { return a < b ? b : a; }
+	static Type sqrt(Type a) { return std::sqrt(a); }
+	static Type abs(Type a) { return std::fabs(a); }
+	static Type lessSelect(Type a, Type b, Type x, Type y) { return a < b ? x : y; }
+};
+#endif
+typedef Lanes L;
+typedef L::Type V;
+static const int tilePixels = SampleTile::pixels;
+
+bool SampleTileKey::operator==(const SampleTileKey& o) const {
+	return warp == o.warp && source == o.source && nearest == o.nearest && tile == o.tile;
+}
+
+static void meanTile(const SampleTile& tile, glm::vec4* colors) {
+	thread_local vector<float> sums;
+	sums.assign(4 * tilePixels, 0.f); // r, g, b, weight
+	for (int cell = 0; cell < tile.cells; cell++) {
+		const float* alpha = tile.plane(cell, 3);
+		for (int c = 0; c < 3; c++) {
+			const float* values = tile.plane(cell, c);
+			float* sum = &sums[c * tilePixels];
+			for (int p = 0; p < tilePixels; p += L::width) L::store(sum + p, L::add(L::load(sum + p), L::mul(L::load(values + p), L::load(alpha + p))));
+		}
+		float* weight = &sums[3 * tilePixels];
+		for (int p = 0; p < tilePixels; p += L::width) L::store(weight + p, L::add(L::load(weight + p), L::load(alpha + p)));
+	}
+	for (int p = 0; p < tilePixels; p++) {
+		glm::vec3 color = glm::vec3(sums[p], sums[tilePixels + p], sums[2 * tilePixels + p]);
+		float weight = sums[3 * tilePixels + p];
+		if (weight > 0.f) color /= weight;
+		colors[p] = glm::vec4(color, 1.f);
+	}
+}
+
+// welford for mad, stddev and variation, transparent cells have alpha 0 so they add nothing instead of being skipped
+static void statsTile(const SampleTile& tile, int combineMode, glm::vec4* colors) {
+	thread_local vector<float> sums;
+	sums.assign(10 * tilePixels, 0.f); // count, mean rgb, squared deviations rgb, mad rgb
+	float* count = &sums[0];
+	const V one = L::set(1.f);
+	for (int cell = 0; cell < tile.cells; cell++) {
+		const float* alpha = tile.plane(cell, 3);
+		for (int p = 0; p < tilePixels; p += L::width) {
+			V a = L::load(alpha + p);
+			V n = L::add(L::load(count + p), a);
+			L::store(count + p, n);
+			V divisor = L::max(n, one); // only 0 before the first valid cell, where a is 0 anyway
+			for (int c = 0; c < 3; c++) {
+				float* mean = &sums[(1 + c) * tilePixels + p];
+				float* squared = &sums[(4 + c) * tilePixels + p];
+				V x = L::load(tile.plane(cell, c) + p);
+				V oldMean = L::load(mean);
+				V delta = L::sub(x, oldMean);
+				V newMean = L::add(oldMean, L::mul(a, L::div(delta, divisor)));
+				L::store(mean, newMean);
+				L::store(squared, L::add(L::load(squared), L::mul(a, L::mul(delta, L::sub(x, newMean)))));
+			}
+		}
+	}
+	bool exactMad = combineMode == 4 && tile.cells <= maxExactMadCells;
+	if (exactMad) {
+		for (int cell = 0; cell < tile.cells; cell++) {
+			const float* alpha = tile.plane(cell, 3);
+			for (int c = 0; c < 3; c++) {
+				const float* values = tile.plane(cell, c);
+				const float* mean = &sums[(1 + c) * tilePixels];
+				float* mad = &sums[(7 + c) * tilePixels];
+				for (int p = 0; p < tilePixels; p += L::width) {
+					V deviation = L::abs(L::sub(L::load(values + p), L::load(mean + p)));
+					L::store(mad + p, L::add(L::load(mad + p), L::mul(L::load(alpha + p), deviation)));
+				}
+			}
+		}
+	}
+
+	const float multiplier = 10.f;
+	for (int p = 0; p < tilePixels; p++) {
+		float n = count[p];
+		glm::vec3 color = glm::vec3(0.f);
+		if (n > 0.f) {
+			glm::vec3 mean = glm::vec3(sums[tilePixels + p], sums[2 * tilePixels + p], sums[3 * tilePixels + p]);
+			glm::vec3 variance = glm::vec3(sums[4 * tilePixels + p], sums[5 * tilePixels + p], sums[6 * tilePixels + p]) / n;
+			if (combineMode == 4) {
+				glm::vec3 mad = exactMad ? glm::vec3(sums[7 * tilePixels + p], sums[8 * tilePixels + p], sums[9 * tilePixels + p]) / n : glm::sqrt(variance) * 0.7978846f;
+				color = mad * multiplier;
+			} else if (combineMode == 7) {
+				color = glm::sqrt(variance) * multiplier;
+			} else {
+				color = glm::sqrt(variance) / glm::max(mean, 1.f / 255.f);
+			}
+		}
+		colors[p] = glm::vec4(color, 1.f);
+	}
+}
+
+// nearest palette color per cell, ties keep the first color like combineFetched
+static void paletteTile(const SampleTile& tile, glm::vec4* colors) {
+	thread_local vector<float> counts;
+	counts.assign(paletteSize * tilePixels, 0.f);
+	const V zero = L::set(0.f), one = L::set(1.f), half = L::set(0.5f);
+	for (int cell = 0; cell < tile.cells; cell++) {
+		const float* r = tile.plane(cell, 0);
+		const float* g = tile.plane(cell, 1);
+		const float* b = tile.plane(cell, 2);
+		for (int p = 0; p < tilePixels; p += L::width) {
+			V x = L::load(r + p), y = L::load(g + p), z = L::load(b + p);
+			V closest = L::set(1000.f), closestIndex = zero;
+			for (int j = 0; j < paletteSize; j++) {
+				V dx = L::sub(L::set(palette[j].x), x), dy = L::sub(L::set(palette[j].y), y), dz = L::sub(L::set(palette[j].z), z);
+				V dist = L::sqrt(L::add(L::add(L::mul(dx, dx), L::mul(dy, dy)), L::mul(dz, dz)));
+				closestIndex = L::lessSelect(dist, closest, L::set((float)j), closestIndex);
+				closest = L::lessSelect(dist, closest, dist, closest);
+			}
+			for (int j = 0; j < paletteSize; j++) {
+				float* count = &counts[j * tilePixels + p];
+				V picked = L::lessSelect(L::abs(L::sub(closestIndex, L::set((float)j))), half, one, zero);
+				L::store(count, L::add(L::load(count), picked));
+			}
+		}
+	}
+	for (int p = 0; p < tilePixels; p++) {
+		glm::vec3 color = glm::vec3(0.f);
+		float mostColorCount = 0.f;
+		for (int j = 0; j < paletteSize; j++) {
+			if (counts[j * tilePixels + p] > mostColorCount) {
+				color = palette[j];
+				mostColorCount = counts[j * tilePixels + p];
+			}
+		}
+		colors[p] = glm::vec4(color, 1.f);
+	}
+}
+
+// sorts every channel plane with the same network the shader uses, transparent cells become 2 so they sort past
+// every real value, then each pixel reads the middle of its own valid count
+static void medianTile(const SampleTile& tile, glm::vec4* colors) {
+	thread_local int networkCells = -1;
+	thread_local vector<pair<int, int>> network;
+	if (networkCells != tile.cells) {
+		network = sortingNetwork(tile.cells);
+		networkCells = tile.cells;
+	}
+	thread_local vector<float> sorted, valid;
+	sorted.resize((size_t)tile.cells * 3 * tilePixels);
+	valid.assign(tilePixels, 0.f);
+	const V half = L::set(0.5f), invalid = L::set(2.f), one = L::set(1.f), zero = L::set(0.f);
+	for (int cell = 0; cell < tile.cells; cell++) {
+		const float* alpha = tile.plane(cell, 3);
+		for (int p = 0; p < tilePixels; p += L::width) {
+			V a = L::load(alpha + p);
+			for (int c = 0; c < 3; c++) L::store(&sorted[((size_t)cell * 3 + c) * tilePixels + p], L::lessSelect(half, a, L::load(tile.plane(cell, c) + p), invalid));
+			L::store(&valid[p], L::add(L::load(&valid[p]), L::lessSelect(half, a, one, zero)));
+		}
+	}
+	for (const pair<int, int>& comparator : network) {
+		for (int c = 0; c < 3; c++) {
+			float* lo = &sorted[((size_t)comparator.first * 3 + c) * tilePixels];
+			float* hi = &sorted[((size_t)comparator.second * 3 + c) * tilePixels];
+			for (int p = 0; p < tilePixels; p += L::width) {
+				V x = L::load(lo + p), y = L::load(hi + p);
+				L::store(lo + p, L::min(x, y));
+				L::store(hi + p, L::max(x, y));
+			}
+		}
+	}
+	for (int p = 0; p < tilePixels; p++) {
+		int n = (int)valid[p];
+		glm::vec3 color = glm::vec3(0.f);
+		if (n > 0) {
+			for (int c = 0; c < 3; c++) {
+				float lower = sorted[((size_t)((n - 1) / 2) * 3 + c) * tilePixels + p];
+				float upper = sorted[((size_t)(n / 2) * 3 + c) * tilePixels + p];
+				color[c] = n % 2 == 1 ? upper : (lower + upper) * 0.5f;
+			}
+		}
+		colors[p] = glm::vec4(color, 1.f);
+	}
+}
+
+static void singleTile(const SampleTile& tile, int gridNumber, glm::vec4* colors) {
+	for (int p = 0; p < tilePixels; p++) {
+		colors[p] = glm::vec4(tile.plane(gridNumber, 0)[p], tile.plane(gridNumber, 1)[p], tile.plane(gridNumber, 2)[p], 1.f);
+	}
+}
+
+// percentile, trimmed mean and very big medians only need their samples back in rows
+static void gatherTile(const Image& source, const RenderParams& params, const SampleTile& tile, glm::vec4* colors) {
+	thread_local vector<glm::vec4> samples;
+	samples.resize(tile.cells);
+	for (int p = 0; p < tilePixels; p++) {
+		for (int cell = 0; cell < tile.cells; cell++) {
+			samples[cell] = glm::vec4(tile.plane(cell, 0)[p], tile.plane(cell, 1)[p], tile.plane(cell, 2)[p], tile.plane(cell, 3)[p]);
+		}
+		colors[p] = combineFetched(source, params, params.combineMode, nullptr, samples);
+	}
+}
+
+static void reduceTile(const Image& source, const RenderParams& params, const SampleTile& tile, glm::vec4* colors) {
+	switch (params.combineMode) {
+	case 0:
+		meanTile(tile, colors);
+		break;
+	case 1:
+		if (tile.cells <= maxExactMadCells) medianTile(tile, colors); // the network grows n log^2 n, past that nth_element wins
+		else gatherTile(source, params, tile, colors);
+		break;
+	case 2:
+		singleTile(tile, params.gridNumber, colors);
+		break;
+	case 3:
+		paletteTile(tile, colors);
+		break;
+	case 4:
+	case 7:
+	case 8:
+		statsTile(tile, params.combineMode, colors);
+		break;
+	default:
+		gatherTile(source, params, tile, colors);
+		break;
+	}
+}
+
+static void fetchTile(const Image& source, const RenderParams& params, int x0, int y0, int width, int height, const WarpMap* warpMap, SampleTile& tile) {
+	int cells = params.gridX * params.gridY;
+	tile.cells = cells;
+	tile.values.assign((size_t)cells * 4 * tilePixels, 0.f);
+	thread_local vector<glm::vec2> uvs;
+	uvs.resize(cells);
+	int x1 = min(x0 + SampleTile::size, width), y1 = min(y0 + SampleTile::size, height);
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			const glm::vec2* sourceUvs = uvs.data();
+			if (warpMap) sourceUvs = &warpMap->uvs[((size_t)y * (size_t)width + (size_t)x) * (size_t)cells];
+			else cellSourceUvs(params, x, y, width, height, uvs.data());
+			int p = (y - y0) * SampleTile::size + (x - x0);
+			for (int cell = 0; cell < cells; cell++) {
+				glm::vec4 color = fetchPixel(source, params, sourceUvs[cell]);
+				for (int c = 0; c < 4; c++) tile.plane(cell, c)[p] = color[c];
+			}
+		}
+	}
+}
+
+void SampleCache::render(const Image& source, const RenderParams& params, Image& output, int threads, const WarpMap* warpMap) {
+	hits = 0;
+	misses = 0;
+	if (!params.combineMosaic || params.aaRes > 1 || params.combineMode == 5) {
+		renderImage(source, params, output, threads, warpMap); // voronoi fetches one cell anyway, nothing to keep
+		return;
+	}
+	WarpKey warp = warpKey(params, output.width, output.height);
+	if (warpMap && !(warpMap->key == warp)) warpMap = nullptr;
+
+	const int tileSize = SampleTile::size;
+	int tilesX = (output.width + tileSize - 1) / tileSize;
+	int tilesY = (output.height + tileSize - 1) / tileSize;
+	parallelFor(tilesX * tilesY, threads, [&](int index) {
+		int x0 = (index % tilesX) * tileSize, y0 = (index / tilesX) * tileSize;
+		SampleTileKey key = {warp, source.id, params.nearest, index};
+		shared_ptr<SampleTile> tile;
+		{
+			lock_guard<mutex> lock(tilesMutex);
+			tile = tiles.find(key);
+		}
+		if (tile) {
+			hits++;
+		} else {
+			misses++;
+			tile = make_shared<SampleTile>();
+			fetchTile(source, params, x0, y0, output.width, output.height, warpMap, *tile);
+			lock_guard<mutex> lock(tilesMutex);
+			tiles.insert(key, tile, tile->bytes()); // too big for the budget just means it gets fetched again next time
+		}
+
+		thread_local vector<glm::vec4> colors;
+		colors.resize(tilePixels);
+		reduceTile(source, params, *tile, colors.data());
+		int x1 = min(x0 + tileSize, output.width), y1 = min(y0 + tileSize, output.height);
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) writePixel(output, x, y, colors[(y - y0) * tileSize + (x - x0)]);
+		}
+	});
+	output.touch();
+}
+
+void SampleCache::setBudget(size_t bytes) {
+	lock_guard<mutex> lock(tilesMutex);
+	tiles.setBudget(bytes);
+}
+void SampleCache::clear() {
+	lock_guard<mutex> lock(tilesMutex);
+	tiles.clear();
+}
+size_t SampleCache::used() {
+	lock_guard<mutex> lock(tilesMutex);
+	return tiles.used;
+}
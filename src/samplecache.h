@@ -0,0 +1,53 @@
+#pragma once
+// the fetched texel of every grid cell for every output pixel, kept per tile so a second render of the same image
+// with another combineMode or gridNumber only reruns the reductions in samplecache.cpp.
+// bench only: rasterbatch --bench-modes is the one caller. renderImage and renderGatherModes don't go through it,
+// rasterbatch renders every image once and the editor switches modes on the gpu, so no real mode switch gets faster
+
+#include <mutex>
+#include <atomic>
+#include "engine.h"
+#include "cache.h"
+
+struct SampleTileKey {
+	WarpKey warp;
+	unsigned long long source; // Image::id, a freed image's buffer can come back at the same address with other pixels
+	bool nearest;
+	int tile;
+	bool operator==(const SampleTileKey& other) const;
+};
+
+// one 32x32 tile stored cell major: all pixels of one channel of one cell next to each other
+// pixels past the image edge stay zero, so they count as transparent cells and never get written
+class SampleTile {
+public:
+	static const int size = 32; // same tiles as renderImage
+	static const int pixels = size * size;
+	int cells = 0;
+	std::vector<float> values;
+
+	float* plane(int cell, int channel) {
+		return &values[((size_t)cell * 4 + (size_t)channel) * pixels];
+	}
+	const float* plane(int cell, int channel) const {
+		return &values[((size_t)cell * 4 + (size_t)channel) * pixels];
+	}
+	size_t bytes() const {
+		return values.size() * sizeof(float);
+	}
+};
+
+class SampleCache {
+public:
+	std::atomic<int> hits{0}, misses{0}; // tiles reused and fetched by the last render
+
+	SampleCache(size_t budget) : tiles(budget) {}
+	// same pixels as renderImage, supersampled, voronoi and non mosaic renders just go to renderImage
+	void render(const Image& source, const RenderParams& params, Image& output, int threads = 0, const WarpMap* warpMap = nullptr);
+	void setBudget(size_t bytes);
+	void clear();
+	size_t used();
+private:
+	BudgetCache<SampleTileKey, SampleTile> tiles;
+	std::mutex tilesMutex;
+};